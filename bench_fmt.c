@@ -0,0 +1,238 @@
+/*
+ * Micro-benchmark of the formatting kernels of node_exp.c against stdio,
+ * and of rendering a scrape of 500 stations on four interfaces: the rows
+ * of the stations that changed, then the body spliced from all rows.
+ *
+ * Built with "waf configure --bench", run as build/bench_fmt. The
+ * exporter is included so its static functions can be called directly.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#define main node_exp_main
+#include "node_exp.c"
+#undef main
+
+#define VALUES 4096
+#define ROUNDS 1000
+#define STATIONS 500
+#define RENDERS 20
+
+static uint64_t u64s[VALUES];
+static int8_t i8s[VALUES];
+static int32_t mbms[VALUES];
+static uint8_t macs[VALUES][ETH_ALEN];
+
+/* Keeps the compiler from dropping the formatted text */
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void values_init(void)
+{
+	uint64_t s = 88172645463325252ULL;
+
+	for (int i = 0; i < VALUES; i++) {
+		/* Counters of every magnitude, as byte and packet counters are */
+		u64s[i] = xorshift(&s) >> (xorshift(&s) % 64);
+		i8s[i] = (int8_t)-(int)(xorshift(&s) % 100);
+		mbms[i] = (int32_t)(xorshift(&s) % 3000);
+		for (int k = 0; k < ETH_ALEN; k++) {
+			macs[i][k] = (uint8_t)xorshift(&s);
+		}
+	}
+}
+
+/* Nanoseconds per value of the current bench_ loop */
+static void report(const char *name, double start)
+{
+	printf("  %-22s %7.1f ns\n", name, (now_ns() - start) / ((double)ROUNDS * VALUES));
+}
+
+static void bench_kernels(void)
+{
+	char buf[64];
+	size_t n = 0;
+	double start;
+
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += (size_t)snprintf(buf, sizeof(buf), "%ju", (uintmax_t)u64s[i]);
+		}
+	}
+	report("snprintf(\"%ju\")", start);
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += fmt_u64(buf, u64s[i]);
+		}
+	}
+	report("fmt_u64", start);
+
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			const uint8_t *m = macs[i];
+			n += (size_t)snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+					m[0], m[1], m[2], m[3], m[4], m[5]);
+		}
+	}
+	report("snprintf MAC", start);
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += fmt_mac(buf, macs[i]);
+		}
+	}
+	report("fmt_mac", start);
+
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += (size_t)snprintf(buf, sizeof(buf), "%d", i8s[i]);
+		}
+	}
+	report("snprintf(\"%d\")", start);
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += fmt_i8(buf, i8s[i]);
+		}
+	}
+	report("fmt_i8", start);
+
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += (size_t)snprintf(buf, sizeof(buf), "%g", mbms[i] / 100.0);
+		}
+	}
+	report("snprintf(\"%g\") dBm", start);
+	start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int i = 0; i < VALUES; i++) {
+			n += fmt_mbm(buf, mbms[i]);
+		}
+	}
+	report("fmt_mbm", start);
+
+	sink = n;
+}
+
+static void snapshot_fill(struct snapshot *snap)
+{
+	for (uint32_t i = 0; i < 4; i++) {
+		struct interface_info *f = iface_add(snap, i + 3);
+		f->ifindex = i + 3;
+		f->name = intern(i < 2 ? (i ? "wlan1" : "wlan0") : (i == 2 ? "wlan0-1" : "wlan1-1"));
+		f->present = BIT(IFACE_TX_POWER);
+		f->tx_power = mbms[i];
+	}
+	for (int k = 0; k < STATIONS; k++) {
+		struct station_info s;
+		memset(&s, 0, sizeof(s));
+		s.iface = k % 4;
+		s.ifindex = (uint32_t)(k % 4) + 3;
+		s.mac[4] = (uint8_t)(k >> 8);
+		s.mac[5] = (uint8_t)k;
+		s.present = ~0ULL;
+		s.rx_bytes = u64s[k];
+		s.tx_bytes = u64s[k + STATIONS];
+		s.signal = i8s[k];
+		s.chains = 2;
+		s.chain_signal[0] = i8s[k];
+		s.chain_signal[1] = i8s[k + STATIONS];
+		s.tx_rate.present = ~0u;
+		s.tx_rate.bitrate = 1300;
+		s.tx_rate.channel_width = 80;
+		s.rx_rate = s.tx_rate;
+		s.tids = 9;
+		for (int t = 0; t < 9; t++) {
+			s.tid[t].present = ~0u;
+			s.tid[t].rx_msdu = u64s[(k * 9 + t) % VALUES];
+		}
+		s.bss.present = ~0u;
+		char label[STATION_LABEL_SIZE];
+		size_t len = station_label(label, snap->iface[s.iface].name, s.mac);
+		if (station_columns_append(&snap->sta, &s, label, len)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	if (render_rows(snap)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+/* Best time of rendering the rows and the body, with every step-th
+ * station changed, none if step is 0 */
+static double render_best(struct snapshot *snap, size_t step, struct arena *out)
+{
+	double best = 0;
+
+	for (int r = 0; r < RENDERS; r++) {
+		for (size_t i = 0; step && i < snap->sta.count; i += step) {
+			snap->sta.value[0][i]++;
+		}
+		/* Drop the previous round's references, as a refilled snapshot does */
+		release_rows(snap);
+		double start = now_ns();
+		if (render_rows(snap) || render_body(snap, FORMAT_TEXT, out)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		double t = now_ns() - start;
+		if (r == 0 || t < best) {
+			best = t;
+		}
+	}
+	return best;
+}
+
+static void bench_render(void)
+{
+	static struct snapshot snap;
+	struct arena out = {0};
+
+	snapshot_fill(&snap);
+	double t = render_best(&snap, 1, &out);
+	printf("  all stations changed   %7.2f ms for %zu bytes, best of %d\n", t / 1e6, out.len, RENDERS);
+	t = render_best(&snap, 2, &out);
+	printf("  half changed           %7.2f ms, best of %d\n", t / 1e6, RENDERS);
+	t = render_best(&snap, 0, &out);
+	printf("  none changed           %7.2f ms, best of %d\n", t / 1e6, RENDERS);
+	free(out.buf);
+}
+
+int main(void)
+{
+	int rv = shared_init();
+	if (rv) {
+		fprintf(stderr, "Failed to set up shared state: %s\n", strerror(-rv));
+		return 1;
+	}
+	values_init();
+	printf("Per value:\n");
+	bench_kernels();
+	printf("%d stations on four interfaces:\n", STATIONS);
+	bench_render();
+	return 0;
+}
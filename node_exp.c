@@ -15,22 +15,44 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For memfd_create, file seals and sendfile */
+#define _GNU_SOURCE
+
 #include <net/if.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/rtnetlink.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
-#include <netlink/netlink.h>
-#include <netlink/genl/genl.h>
-#include <netlink/genl/family.h>
-#include <netlink/genl/ctrl.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 
+#define ZLIB_CONST
+#include <zlib.h>
+
 #include "nl80211.h"
 
 #define ROOTPAGE  "<html><head><title>Metrics exporter</title></head><body><ul><li><a href=\"/metrics\">metrics</a></li></ul></body></html>"
@@ -39,685 +61,4517 @@
 
 #define BIT(x) (1ULL<<(x))
 
+/* Exposition formats a scrape can be answered in */
+enum body_format {
+	FORMAT_TEXT,
+	FORMAT_PROTOBUF,
+	FORMAT_OPENMETRICS,
+	BODY_FORMATS
+};
 
-struct client_context {
-	FILE *stream;
-	int nl80211_id;
-	struct nl_sock *nls;
+
+#define MAX_CHAINS 8
+#define MAX_TIDS 17
+/* {device="...",station="..."} with the device name fully escaped */
+#define STATION_LABEL_SIZE 80
+
+/* Everything below is filled from the nl80211 dumps and later rendered, so
+ * collection and output no longer have to happen at the same time. The
+ * present masks hold BIT(NL80211_*_INFO_*) for every field that was set. */
+struct rate_info {
+	uint32_t present;
+	uint32_t bitrate;	/* in 100 kbit/s */
+	uint8_t mcs;
+	uint8_t vht_mcs;
+	uint8_t vht_nss;
+	uint8_t channel_width;
+	bool short_gi;
+};
+
+struct tid_stats {
+	uint32_t present;
+	uint64_t rx_msdu;
+	uint64_t tx_msdu;
+	uint64_t tx_msdu_retries;
+	uint64_t tx_msdu_failed;
+};
+
+struct bss_param {
+	uint32_t present;
+	uint8_t dtim_period;
+	uint16_t beacon_interval;
+};
+
+struct station_info {
+	int iface;		/* index into snapshot.iface */
+	uint32_t ifindex;
+	uint8_t mac[ETH_ALEN];
+	uint64_t present;
+	uint32_t connected_time;
+	uint32_t inactive_time;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint32_t rx_packets;
+	uint32_t tx_packets;
+	uint32_t tx_retries;
+	uint32_t tx_failed;
+	uint32_t beacon_loss;
+	uint64_t rx_beacons;
+	uint64_t rx_drop_misc;
+	uint64_t rx_duration;
+	int64_t t_offset;
+	uint32_t expected_throughput;
+	int8_t signal;
+	int8_t signal_avg;
+	int8_t beacon_signal_avg;
+	uint8_t chains;
+	uint8_t chains_avg;
+	int8_t chain_signal[MAX_CHAINS];
+	int8_t chain_signal_avg[MAX_CHAINS];
+	uint32_t sta_flags;
+	struct rate_info tx_rate;
+	struct rate_info rx_rate;
+	uint8_t tids;
+	struct tid_stats tid[MAX_TIDS];
+	struct bss_param bss;
+};
+
+/* Rendered text of one station or survey channel, kept for as long as
+ * its values do not change. Family k is the text from off[k] up to
+ * off[k + 1], snapshots hold references of their own. */
+struct render_blob {
+	atomic_uint refs;
+	uint32_t families;
+	uint32_t off[];		/* families + 1 offsets, then the text */
+};
+
+struct survey_info {
+	struct render_blob *blob;
+	int iface;
+	uint32_t ifindex;
+	uint32_t frequency;
+	bool in_use;
+	uint32_t present;
+	int8_t noise;
+	uint64_t time;
+	uint64_t time_busy;
+	uint64_t time_ext_busy;
+	uint64_t time_rx;
+	uint64_t time_tx;
+};
+
+#define IFACE_TX_POWER 0
+
+struct interface_info {
+	uint32_t ifindex;
+	uint32_t wiphy;
+	uint32_t iftype;	/* enum nl80211_iftype */
+	const char *name;	/* interned */
+	uint32_t present;	/* BIT(IFACE_*) */
+	uint32_t tx_power;	/* in mBm */
+	uint32_t num_sta;
+};
+
+/* Station metrics are kept in columns, one value per station in each, so
+ * the renderer can walk a whole metric family at a time. Values are stored
+ * ready for output, has tells which of them a station reported. */
+enum station_column {
+	COL_CONNECTED_TIME,
+	COL_INACTIVE_TIME,
+	COL_RX_BYTES,
+	COL_RX_PACKETS,
+	COL_TX_BYTES,
+	COL_TX_PACKETS,
+	COL_TX_RETRIES,
+	COL_TX_FAILED,
+	COL_BEACON_LOSS,
+	COL_RX_BEACONS,
+	COL_RX_DROP_MISC,
+	COL_SIGNAL,
+	COL_SIGNAL_AVG,
+	COL_BEACON_SIGNAL_AVG,
+	COL_T_OFFSET,
+	COL_TX_BITRATE,
+	COL_TX_MCS,
+	COL_TX_VHT_MCS,
+	COL_TX_CHANNEL_WIDTH,
+	COL_TX_SHORT_GI,
+	COL_TX_VHT_NSS,
+	COL_RX_BITRATE,
+	COL_RX_MCS,
+	COL_RX_VHT_MCS,
+	COL_RX_CHANNEL_WIDTH,
+	COL_RX_SHORT_GI,
+	COL_RX_VHT_NSS,
+	COL_RX_DURATION,
+	COL_EXPECTED_THROUGHPUT,
+	COL_AUTHORIZED,
+	COL_AUTHENTICATED,
+	COL_ASSOCIATED,
+	COL_SHORT_PREAMBLE,
+	COL_WME,
+	COL_MFP,
+	COL_TDLS_PEER,
+	COL_BSS_DTIM_PERIOD,
+	COL_BSS_BEACON_INTERVAL,
+	COL_BSS_CTS_PROTECTION,
+	COL_BSS_SHORT_PREAMBLE,
+	COL_BSS_SHORT_SLOT_TIME,
+	STATION_COLUMNS
+};
+
+_Static_assert(STATION_COLUMNS <= 64, "station columns must fit the has mask");
+
+struct station_columns {
+	size_t count;
+	size_t alloc;
+	int *iface;			/* index into snapshot.iface */
+	uint8_t (*mac)[ETH_ALEN];
+	char (*label)[STATION_LABEL_SIZE];	/* label block of every sample */
+	uint8_t *label_len;
+	uint64_t *has;			/* BIT(COL_*) */
+	uint64_t *value[STATION_COLUMNS];
+	uint8_t *chains;
+	int8_t (*chain_signal)[MAX_CHAINS];
+	uint8_t *chains_avg;
+	int8_t (*chain_signal_avg)[MAX_CHAINS];
+	uint8_t *tids;
+	struct tid_stats (*tid)[MAX_TIDS];
+	struct render_blob **blob;
+};
+
+struct snapshot {
+	/* Interface registry, if_index maps an ifindex to its position */
 	int if_count;
-	uint32_t if_index[16];
-	uint32_t if_num_sta[16];
+	size_t if_alloc;
+	struct interface_info *iface;
+	size_t if_mask;		/* if_index slots - 1, always a power of two */
+	int *if_index;		/* position + 1, 0 marks a free slot */
+	struct station_columns sta;
+	size_t survey_count;
+	size_t survey_alloc;
+	struct survey_info *survey;
+	uint64_t generation;	/* of the collection, 0 while incomplete */
+	struct timespec collected;	/* wall clock time of the replies */
+	pthread_rwlock_t lock;		/* write locked while it is collected */
+};
+
+struct client_context {
+	struct snapshot *snap;
+};
+
+/* Make room for one more element, returns the possibly moved array or NULL */
+static void *array_grow(void *array, size_t *alloc, size_t count, size_t size)
+{
+	if (count < *alloc) {
+		return array;
+	}
+	size_t n = *alloc ? *alloc * 2 : 16;
+	void *p = realloc(array, n * size);
+	if (p) {
+		*alloc = n;
+	}
+	return p;
+}
+
+/* Formatting kernels of the render path, stdio would interpret a format
+ * string for every single value. Writers return the number of bytes
+ * written and do not terminate the text. */
+#define HEX_ROW(h) h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" h"8" h"9" h"a" h"b" h"c" h"d" h"e" h"f"
+#define DEC_ROW(d) d"0" d"1" d"2" d"3" d"4" d"5" d"6" d"7" d"8" d"9"
+
+static const char hex_pairs[] =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b") HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+static const char dec_pairs[] =
+	DEC_ROW("0") DEC_ROW("1") DEC_ROW("2") DEC_ROW("3") DEC_ROW("4")
+	DEC_ROW("5") DEC_ROW("6") DEC_ROW("7") DEC_ROW("8") DEC_ROW("9");
+
+#define MAC_TEXT_LEN (ETH_ALEN * 3 - 1)
+
+/* aa:bb:cc:dd:ee:ff */
+static size_t fmt_mac(char *dst, const uint8_t *mac)
+{
+	for (int i = 0; i < ETH_ALEN; i++) {
+		memcpy(dst + i * 3, &hex_pairs[mac[i] * 2], 2);
+		if (i < ETH_ALEN - 1) {
+			dst[i * 3 + 2] = ':';
+		}
+	}
+	return MAC_TEXT_LEN;
+}
+
+/* Two digits at a time from the end, then moved into place */
+static size_t fmt_u64(char *dst, uint64_t v)
+{
+	char buf[20];
+	char *p = buf + sizeof(buf);
+
+	while (v >= 100) {
+		size_t d = (size_t)(v % 100) * 2;
+		v /= 100;
+		p -= 2;
+		memcpy(p, &dec_pairs[d], 2);
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &dec_pairs[v * 2], 2);
+	} else {
+		*--p = (char)('0' + v);
+	}
+	size_t len = (size_t)(buf + sizeof(buf) - p);
+	memcpy(dst, p, len);
+	return len;
+}
+
+static size_t fmt_i64(char *dst, int64_t v)
+{
+	if (v >= 0) {
+		return fmt_u64(dst, (uint64_t)v);
+	}
+	*dst = '-';
+	return 1 + fmt_u64(dst + 1, 0 - (uint64_t)v);
+}
+
+/* Signal levels are never more than three digits */
+static size_t fmt_i8(char *dst, int8_t v)
+{
+	size_t n = 0;
+	unsigned int a = v < 0 ? (unsigned int)-(int)v : (unsigned int)v;
+
+	if (v < 0) {
+		dst[n++] = '-';
+	}
+	if (a >= 100) {
+		dst[n++] = '1';
+		a -= 100;
+		memcpy(dst + n, &dec_pairs[a * 2], 2);
+		return n + 2;
+	}
+	if (a >= 10) {
+		memcpy(dst + n, &dec_pairs[a * 2], 2);
+		return n + 2;
+	}
+	dst[n] = (char)('0' + a);
+	return n + 1;
+}
+
+/* mBm as dBm, 2005 is 20.05 and 2050 is 20.5 */
+static size_t fmt_mbm(char *dst, int32_t mbm)
+{
+	size_t n = 0;
+	uint32_t a = mbm < 0 ? 0u - (uint32_t)mbm : (uint32_t)mbm;
+
+	if (mbm < 0) {
+		dst[n++] = '-';
+	}
+	n += fmt_u64(dst + n, a / 100);
+	uint32_t frac = a % 100;
+	if (frac) {
+		dst[n++] = '.';
+		memcpy(dst + n, &dec_pairs[frac * 2], 2);
+		n += frac % 10 ? 2 : 1;
+	}
+	return n;
+}
+
+/* Netlink messages are parsed where they lie in the receive buffer, and
+ * requests are built on the stack. */
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+/* Next message of a datagram, NULL once it is used up or truncated */
+static struct nlmsghdr *msg_next(char **pos, const char *end)
+{
+	if (end - *pos < (ptrdiff_t)NLMSG_HDRLEN) {
+		return NULL;
+	}
+	void *p = *pos;
+	struct nlmsghdr *nlh = p;
+	size_t left = (size_t)(end - *pos);
+	if (nlh->nlmsg_len < NLMSG_HDRLEN || nlh->nlmsg_len > left) {
+		return NULL;
+	}
+	*pos += NLMSG_ALIGN(nlh->nlmsg_len) < left ? NLMSG_ALIGN(nlh->nlmsg_len) : left;
+	return nlh;
+}
+
+/* Error code of an NLMSG_ERROR or NLMSG_DONE message, acks carry 0 */
+static int msg_error(const struct nlmsghdr *nlh)
+{
+	int err = 0;
+	if (nlh->nlmsg_len >= NLMSG_HDRLEN + sizeof(err)) {
+		memcpy(&err, (const char *)nlh + NLMSG_HDRLEN, sizeof(err));
+	}
+	return err;
+}
+
+static uint8_t genl_cmd(const struct nlmsghdr *nlh)
+{
+	struct genlmsghdr genl = {0};
+	if (nlh->nlmsg_len >= NLMSG_HDRLEN + GENL_HDRLEN) {
+		memcpy(&genl, (const char *)nlh + NLMSG_HDRLEN, sizeof(genl));
+	}
+	return genl.cmd;
+}
+
+/* Attributes following the generic netlink header */
+static const char *genl_attrs(const struct nlmsghdr *nlh, size_t *len)
+{
+	size_t hdr = NLMSG_HDRLEN + GENL_HDRLEN;
+	*len = nlh->nlmsg_len > hdr ? nlh->nlmsg_len - hdr : 0;
+	return (const char *)nlh + hdr;
+}
+
+/* Next attribute of a stream, NULL once it is used up or truncated */
+static const struct nlattr *attr_next(const char **pos, const char *end)
+{
+	if (end - *pos < NLA_HDRLEN) {
+		return NULL;
+	}
+	const void *p = *pos;
+	const struct nlattr *a = p;
+	size_t left = (size_t)(end - *pos);
+	if (a->nla_len < NLA_HDRLEN || a->nla_len > left) {
+		return NULL;
+	}
+	*pos += (size_t)NLA_ALIGN(a->nla_len) < left ? (size_t)NLA_ALIGN(a->nla_len) : left;
+	return a;
+}
+
+static const char *attr_data(const struct nlattr *a)
+{
+	return (const char *)a + NLA_HDRLEN;
+}
+
+static size_t attr_len(const struct nlattr *a)
+{
+	return (size_t)a->nla_len - NLA_HDRLEN;
+}
+
+/* Point tb[type] at the attribute of every type up to max */
+static void attr_parse(const struct nlattr **tb, int max, const char *data, size_t len)
+{
+	const char *end = data + len;
+	const struct nlattr *a;
+
+	memset(tb, 0, (size_t)(max + 1) * sizeof(*tb));
+	while ((a = attr_next(&data, end))) {
+		int type = a->nla_type & NLA_TYPE_MASK;
+		if (type <= max) {
+			tb[type] = a;
+		}
+	}
+}
+
+/* Payloads are only 4 byte aligned and may be shorter than expected */
+static void attr_copy(const struct nlattr *a, void *dst, size_t size)
+{
+	memcpy(dst, attr_data(a), attr_len(a) < size ? attr_len(a) : size);
+}
+
+static uint8_t attr_u8(const struct nlattr *a)
+{
+	uint8_t v = 0;
+	attr_copy(a, &v, sizeof(v));
+	return v;
+}
+
+static uint16_t attr_u16(const struct nlattr *a)
+{
+	uint16_t v = 0;
+	attr_copy(a, &v, sizeof(v));
+	return v;
+}
+
+static uint32_t attr_u32(const struct nlattr *a)
+{
+	uint32_t v = 0;
+	attr_copy(a, &v, sizeof(v));
+	return v;
+}
+
+static uint64_t attr_u64(const struct nlattr *a)
+{
+	uint64_t v = 0;
+	attr_copy(a, &v, sizeof(v));
+	return v;
+}
+
+static void attr_strlcpy(char *dst, const struct nlattr *a, size_t size)
+{
+	const char *src = attr_data(a);
+	const char *nul = memchr(src, '\0', attr_len(a));
+	size_t len = nul ? (size_t)(nul - src) : attr_len(a);
+	if (len >= size) {
+		len = size - 1;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/* Attributes are extracted in a single pass over each payload, driven by
+ * tables indexed by attribute type. Types the exporter does not consume
+ * have no entry and are stepped over. */
+enum field_kind {
+	FIELD_SKIP,
+	FIELD_FLAG,	/* no payload, a bool at offset is set if size is */
+	FIELD_UINT,	/* any width, widened or narrowed to size */
+	FIELD_BYTES,	/* exactly size bytes */
+	FIELD_WIDTH,	/* channel width flag, the widest one wins */
+	FIELD_ATTR,	/* the attribute itself, for the caller to look at */
+	FIELD_NESTED,	/* attributes of their own, described by nest */
+	FIELD_CALL,	/* handed to parse along with the whole record */
+};
+
+#define FIELD_WEAK 1	/* leave the value alone once the bit is set */
+#define NO_BIT 0xff
+
+struct field_table;
+
+struct field {
+	uint8_t kind;
+	uint8_t flags;
+	uint8_t bit;		/* present bit to set, or NO_BIT */
+	uint8_t size;		/* of the value in the record */
+	uint16_t offset;	/* of the value in the record */
+	uint16_t arg;		/* FIELD_WIDTH: the width in MHz */
+	const struct field_table *nest;
+	void (*parse)(const struct nlattr *, void *);
+};
+
+struct field_table {
+	const struct field *field;
+	int max;		/* highest attribute type in field */
+	uint16_t present;	/* offset of the present mask in the record */
+	uint8_t present_size;	/* 0 if the record has none */
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define FIELD_TABLE(f, rec) { f, (int)ARRAY_SIZE(f) - 1, offsetof(struct rec, present), sizeof(((struct rec *)0)->present) }
+#define FIELD_TABLE_NOMASK(f) { f, (int)ARRAY_SIZE(f) - 1, 0, 0 }
+
+#define F_UINT(rec, m, b) { .kind = FIELD_UINT, .bit = (b), .size = sizeof(((struct rec *)0)->m), .offset = offsetof(struct rec, m) }
+#define F_WEAK_UINT(rec, m, b) { .kind = FIELD_UINT, .flags = FIELD_WEAK, .bit = (b), .size = sizeof(((struct rec *)0)->m), .offset = offsetof(struct rec, m) }
+#define F_BYTES(rec, m) { .kind = FIELD_BYTES, .bit = NO_BIT, .size = sizeof(((struct rec *)0)->m), .offset = offsetof(struct rec, m) }
+#define F_FLAG(b) { .kind = FIELD_FLAG, .bit = (b) }
+#define F_BOOL(rec, m, b) { .kind = FIELD_FLAG, .bit = (b), .size = sizeof(bool), .offset = offsetof(struct rec, m) }
+#define F_WIDTH(rec, m, mhz) { .kind = FIELD_WIDTH, .bit = NO_BIT, .offset = offsetof(struct rec, m), .arg = (mhz) }
+#define F_ATTR(rec, m) { .kind = FIELD_ATTR, .bit = NO_BIT, .offset = offsetof(struct rec, m) }
+#define F_NESTED(rec, m, b, t) { .kind = FIELD_NESTED, .bit = (b), .offset = offsetof(struct rec, m), .nest = &(t) }
+/* Nested attributes that describe the same record */
+#define F_INLINE(t) { .kind = FIELD_NESTED, .bit = NO_BIT, .nest = &(t) }
+#define F_CALL(b, fn) { .kind = FIELD_CALL, .bit = (b), .parse = (fn) }
+
+static uint64_t attr_uint(const struct nlattr *a)
+{
+	switch (attr_len(a)) {
+	case 1:
+		return attr_u8(a);
+	case 2:
+		return attr_u16(a);
+	case 4:
+		return attr_u32(a);
+	case 8:
+		return attr_u64(a);
+	}
+	return 0;
+}
+
+static void store_uint(char *dst, size_t size, uint64_t v)
+{
+	uint8_t v8 = (uint8_t)v;
+	uint16_t v16 = (uint16_t)v;
+	uint32_t v32 = (uint32_t)v;
+
+	switch (size) {
+	case 1:
+		memcpy(dst, &v8, size);
+		break;
+	case 2:
+		memcpy(dst, &v16, size);
+		break;
+	case 4:
+		memcpy(dst, &v32, size);
+		break;
+	case 8:
+		memcpy(dst, &v, size);
+		break;
+	}
+}
+
+static void extract(const struct field_table *t, void *record, const char *data, size_t len)
+{
+	char *rec = record;
+	const char *end = data + len;
+	const struct nlattr *a;
+	uint64_t present = 0;
+
+	while ((a = attr_next(&data, end))) {
+		int type = a->nla_type & NLA_TYPE_MASK;
+		if (type > t->max || t->field[type].kind == FIELD_SKIP) {
+			continue;
+		}
+		const struct field *f = &t->field[type];
+		char *dst = rec + f->offset;
+
+		switch (f->kind) {
+		case FIELD_FLAG:
+			if (f->size) {
+				bool set = true;
+				memcpy(dst, &set, sizeof(set));
+			}
+			break;
+		case FIELD_UINT:
+			if ((f->flags & FIELD_WEAK) && (present & BIT(f->bit))) {
+				continue;
+			}
+			store_uint(dst, f->size, attr_uint(a));
+			break;
+		case FIELD_BYTES:
+			if (attr_len(a) < f->size) {
+				continue;
+			}
+			memcpy(dst, attr_data(a), f->size);
+			break;
+		case FIELD_WIDTH: {
+			uint8_t width;
+			memcpy(&width, dst, sizeof(width));
+			if (f->arg > width) {
+				width = (uint8_t)f->arg;
+				memcpy(dst, &width, sizeof(width));
+			}
+			break;
+		}
+		case FIELD_ATTR:
+			memcpy(dst, &a, sizeof(a));
+			break;
+		case FIELD_NESTED:
+			extract(f->nest, dst, attr_data(a), attr_len(a));
+			break;
+		case FIELD_CALL:
+			f->parse(a, rec);
+			break;
+		}
+		if (f->bit != NO_BIT) {
+			present |= BIT(f->bit);
+		}
+	}
+
+	if (t->present_size == sizeof(uint32_t)) {
+		uint32_t mask;
+		memcpy(&mask, rec + t->present, sizeof(mask));
+		mask |= (uint32_t)present;
+		memcpy(rec + t->present, &mask, sizeof(mask));
+	} else if (t->present_size == sizeof(uint64_t)) {
+		uint64_t mask;
+		memcpy(&mask, rec + t->present, sizeof(mask));
+		mask |= present;
+		memcpy(rec + t->present, &mask, sizeof(mask));
+	}
+}
+
+/* Requests are tiny, the largest carries an ifindex and a MAC address */
+union nl_txbuf {
+	struct nlmsghdr nlh;
+	char buf[128];
+};
+
+static struct nlmsghdr *genl_put(union nl_txbuf *tx, uint16_t family, int flags, uint32_t seq, uint8_t cmd)
+{
+	struct genlmsghdr genl = { cmd, 0, 0 };
+
+	memset(tx, 0, sizeof(*tx));
+	tx->nlh.nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN;
+	tx->nlh.nlmsg_type = family;
+	tx->nlh.nlmsg_flags = (uint16_t)(NLM_F_REQUEST | NLM_F_ACK | flags);
+	tx->nlh.nlmsg_seq = seq;
+	memcpy(tx->buf + NLMSG_HDRLEN, &genl, sizeof(genl));
+	return &tx->nlh;
+}
+
+static void attr_put(struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len)
+{
+	char *p = (char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len);
+	struct nlattr a;
+
+	a.nla_len = (uint16_t)(NLA_HDRLEN + len);
+	a.nla_type = type;
+	memcpy(p, &a, sizeof(a));
+	memcpy(p + NLA_HDRLEN, data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(a.nla_len);
+}
+
+/* Interface names by ifindex, kept current from rtnetlink link
+ * notifications so a name is only looked up once. Names are interned and
+ * never freed, a snapshot can point at them for as long as it lives. */
+struct ifname_entry {
+	uint32_t ifindex;	/* 0 marks a free slot */
+	const char *name;	/* NULL once the link is gone */
+};
+
+struct ifname_cache {
+	size_t count;
+	size_t mask;		/* number of slots - 1, always a power of two */
+	struct ifname_entry *slot;
+};
+
+static struct ifname_cache ifnames;
+
+static const char *intern(const char *str)
+{
+	static char **pool;
+	static size_t pool_count, pool_alloc;
+
+	for (size_t i = 0; i < pool_count; i++) {
+		if (strcmp(pool[i], str) == 0) {
+			return pool[i];
+		}
+	}
+	void *p = array_grow(pool, &pool_alloc, pool_count, sizeof(*pool));
+	if (!p) {
+		return "";
+	}
+	pool = p;
+	char *copy = strdup(str);
+	if (!copy) {
+		return "";
+	}
+	pool[pool_count++] = copy;
+	return copy;
+}
+
+static struct ifname_entry *ifname_slot(const struct ifname_cache *c, uint32_t ifindex)
+{
+	size_t i = (ifindex * 2654435761u) & c->mask;
+	while (c->slot[i].ifindex && c->slot[i].ifindex != ifindex) {
+		i = (i + 1) & c->mask;
+	}
+	return &c->slot[i];
+}
+
+static void ifname_set(struct ifname_cache *c, uint32_t ifindex, const char *name)
+{
+	/* Keep the load factor at or below one half */
+	if (!c->slot || (c->count + 1) * 2 > c->mask + 1) {
+		size_t slots = c->slot ? (c->mask + 1) * 2 : 64;
+		struct ifname_entry *old = c->slot;
+		size_t old_slots = old ? c->mask + 1 : 0;
+		c->slot = calloc(slots, sizeof(*c->slot));
+		if (!c->slot) {
+			c->slot = old;
+			return;
+		}
+		c->mask = slots - 1;
+		for (size_t i = 0; i < old_slots; i++) {
+			if (old[i].ifindex) {
+				*ifname_slot(c, old[i].ifindex) = old[i];
+			}
+		}
+		free(old);
+	}
+	struct ifname_entry *e = ifname_slot(c, ifindex);
+	if (!e->ifindex) {
+		e->ifindex = ifindex;
+		c->count++;
+	}
+	e->name = name ? intern(name) : NULL;
+}
+
+static void ifname_clear(struct ifname_cache *c)
+{
+	if (c->slot) {
+		memset(c->slot, 0, (c->mask + 1) * sizeof(*c->slot));
+	}
+	c->count = 0;
+}
+
+/* Interned name of ifindex, attr is the name nl80211 reported if any */
+static const char *ifname_get(uint32_t ifindex, const struct nlattr *attr)
+{
+	if (ifnames.slot) {
+		struct ifname_entry *e = ifname_slot(&ifnames, ifindex);
+		if (e->ifindex && e->name) {
+			return e->name;
+		}
+	}
+
+	char name[IF_NAMESIZE] = "";
+	if (attr) {
+		attr_strlcpy(name, attr, sizeof(name));
+	} else {
+		if_indextoname(ifindex, name);
+	}
+	ifname_set(&ifnames, ifindex, name);
+	return intern(name);
+}
+
+static void link_event_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct ifname_cache *c = arg;
+	const struct nlattr *tb[IFLA_MAX + 1];
+	struct ifinfomsg ifi;
+	size_t hdr = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(ifi));
+
+	if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK) {
+		return;
+	}
+	if (nlh->nlmsg_len < hdr) {
+		return;
+	}
+	memcpy(&ifi, (const char *)nlh + NLMSG_HDRLEN, sizeof(ifi));
+	attr_parse(tb, IFLA_MAX, (const char *)nlh + hdr, nlh->nlmsg_len - hdr);
+	uint32_t ifindex = (uint32_t)ifi.ifi_index;
+
+	/* Only links we have looked up before are of interest */
+	if (!c->slot || !ifname_slot(c, ifindex)->ifindex) {
+		return;
+	}
+	if (nlh->nlmsg_type == RTM_DELLINK || !tb[IFLA_IFNAME]) {
+		ifname_set(c, ifindex, NULL);
+	} else {
+		char name[IF_NAMESIZE];
+		attr_strlcpy(name, tb[IFLA_IFNAME], sizeof(name));
+		ifname_set(c, ifindex, name);
+	}
+}
+
+/* Stations known from nl80211 events, keyed on interface and MAC address.
+ * Open addressing with linear probing, an ifindex of 0 marks a free slot. */
+struct station_entry {
+	uint32_t ifindex;
+	uint8_t mac[ETH_ALEN];
+	bool stale;
+	uint8_t label_len;
+	const char *label_dev;	/* interned name label was built for */
+	char label[STATION_LABEL_SIZE];
+};
+
+struct station_table {
+	size_t count;
+	size_t mask;		/* number of slots - 1, always a power of two */
+	struct station_entry *slot;
+	bool valid;		/* seeded from full dumps, no events lost since */
+};
+
+static struct station_table stations;
+
+static size_t station_hash(uint32_t ifindex, const uint8_t *mac)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ ((ifindex >> (8 * i)) & 0xff)) * 16777619u;
+	}
+	for (int i = 0; i < ETH_ALEN; i++) {
+		h = (h ^ mac[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Slot holding the station, or the free slot it would go into */
+static struct station_entry *station_table_slot(const struct station_table *t, uint32_t ifindex, const uint8_t *mac)
+{
+	size_t i = station_hash(ifindex, mac) & t->mask;
+	while (t->slot[i].ifindex) {
+		if (t->slot[i].ifindex == ifindex && memcmp(t->slot[i].mac, mac, ETH_ALEN) == 0) {
+			break;
+		}
+		i = (i + 1) & t->mask;
+	}
+	return &t->slot[i];
+}
+
+/* Rehash into slots entries, leaving out the stale ones */
+static int station_table_resize(struct station_table *t, size_t slots)
+{
+	struct station_entry *old = t->slot;
+	size_t old_slots = old ? t->mask + 1 : 0;
+
+	t->slot = calloc(slots, sizeof(*t->slot));
+	if (!t->slot) {
+		t->slot = old;
+		return -ENOMEM;
+	}
+	t->mask = slots - 1;
+	t->count = 0;
+	for (size_t i = 0; i < old_slots; i++) {
+		if (old[i].ifindex && !old[i].stale) {
+			*station_table_slot(t, old[i].ifindex, old[i].mac) = old[i];
+			t->count++;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static int station_table_add(struct station_table *t, uint32_t ifindex, const uint8_t *mac)
+{
+	/* Keep the load factor at or below one half */
+	if (!t->slot || (t->count + 1) * 2 > t->mask + 1) {
+		if (station_table_resize(t, t->slot ? (t->mask + 1) * 2 : 64)) {
+			return -ENOMEM;
+		}
+	}
+	struct station_entry *e = station_table_slot(t, ifindex, mac);
+	if (!e->ifindex) {
+		e->ifindex = ifindex;
+		memcpy(e->mac, mac, ETH_ALEN);
+		e->stale = false;
+		e->label_dev = NULL;
+		t->count++;
+	}
+	return 0;
+}
+
+static void station_table_del(struct station_table *t, uint32_t ifindex, const uint8_t *mac)
+{
+	if (!t->slot) {
+		return;
+	}
+	struct station_entry *e = station_table_slot(t, ifindex, mac);
+	if (!e->ifindex) {
+		return;
+	}
+	t->count--;
+
+	/* Shift back later entries of the probe sequence into the hole */
+	size_t i = (size_t)(e - t->slot), j = i;
+	for (;;) {
+		t->slot[i].ifindex = 0;
+		for (;;) {
+			j = (j + 1) & t->mask;
+			if (!t->slot[j].ifindex) {
+				return;
+			}
+			size_t k = station_hash(t->slot[j].ifindex, t->slot[j].mac) & t->mask;
+			if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+				break;
+			}
+		}
+		t->slot[i] = t->slot[j];
+		i = j;
+	}
+}
+
+static struct station_entry *station_table_find(const struct station_table *t, uint32_t ifindex, const uint8_t *mac)
+{
+	if (!t->slot) {
+		return NULL;
+	}
+	struct station_entry *e = station_table_slot(t, ifindex, mac);
+	return e->ifindex ? e : NULL;
+}
+
+/* Escape an interface name for a label value of the text format into
+ * dst, which needs room for 2 * IF_NAMESIZE bytes. Returns the length. */
+static size_t label_escape(char *dst, const char *dev)
+{
+	char *p = dst;
+
+	for (size_t i = 0; dev[i] && i < IF_NAMESIZE; i++) {
+		if (dev[i] == '\\' || dev[i] == '"') {
+			*p++ = '\\';
+			*p++ = dev[i];
+		} else if (dev[i] == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else {
+			*p++ = dev[i];
+		}
+	}
+	return (size_t)(p - dst);
+}
+
+/* Render the label block of a station's samples into dst, returns its length */
+static size_t station_label(char *dst, const char *dev, const uint8_t *mac)
+{
+	char *p = dst;
+
+	memcpy(p, "{device=\"", 9);
+	p += 9;
+	p += label_escape(p, dev);
+	memcpy(p, "\",station=\"", 11);
+	p += 11;
+	p += fmt_mac(p, mac);
+	memcpy(p, "\"}", 2);
+	p += 2;
+	return (size_t)(p - dst);
+}
+
+/* The label block is built once per station and only rebuilt when the
+ * interface got a new name, interned names compare by pointer */
+static size_t station_entry_label(struct station_entry *e, const char *dev)
+{
+	if (e->label_dev != dev) {
+		e->label_len = (uint8_t)station_label(e->label, dev, e->mac);
+		e->label_dev = dev;
+	}
+	return e->label_len;
+}
+
+static void station_table_clear(struct station_table *t)
+{
+	if (t->slot) {
+		memset(t->slot, 0, (t->mask + 1) * sizeof(*t->slot));
+	}
+	t->count = 0;
+	t->valid = false;
+}
+
+/* Requests are spread over a few sockets so dumps for different interfaces
+ * and commands are in flight at the same time. A socket carries either one
+ * dump or up to NL_WINDOW plain requests, replies are matched to their
+ * request by sequence number. */
+#define NL_WORKERS 4
+#define NL_WINDOW 8
+
+struct nl_request {
+	uint8_t cmd;
+	int flags;
+	uint32_t ifindex;
+	struct station_entry *station;	/* target of a per-station request */
+	void (*handler)(const struct nlmsghdr *, void *);
+	uint32_t seq;
+	int err;			/* 1 while in flight */
+};
+
+struct nl_worker {
+	int fd;
+	int inflight;
+	bool dumping;
+	struct nl_request *req[NL_WINDOW];
+};
+
+/* nl80211 session that outlives a single scrape. It is opened by the
+ * collector thread and reopened whenever it breaks. */
+struct nl80211_session {
+	int nl80211_id;		/* -1 while disconnected */
+	uint32_t mlme_group;	/* 0 if the kernel has none */
+	/* Subscribed to the mlme group, -1 if that is unavailable */
+	int events;
+	/* Subscribed to rtnetlink link notifications, -1 if unavailable */
+	int links;
+	int workers;		/* number of open workers */
+	struct nl_worker worker[NL_WORKERS];
+	uint32_t seq;		/* of the last request */
+	/* Replies or events may have been lost, reconnect before the next use */
+	bool broken;
+};
+
+/* State shared between all worker processes. Every worker has a session
+ * of its own, collections only share the generation counter. */
+struct shared_state {
+	pthread_mutex_t generation_lock;
+	atomic_size_t nl_rx_size;	/* largest netlink datagram seen */
+	atomic_size_t body_size[BODY_FORMATS];	/* of the last rendered scrape */
+	atomic_size_t station_size[BODY_FORMATS];	/* body per station, of the last with any */
+	uint64_t generation;		/* of the last collection, under generation_lock */
+	/* Workers collecting on demand take turns under collect_lock. One
+	 * that got it after another worker's collection uses the bodies that
+	 * one left in the caches, if they are in the formats it needs. */
+	pthread_mutex_t collect_lock;
+	atomic_uint collections;	/* finished under collect_lock */
+	atomic_uint formats_wanted;	/* by workers waiting for collect_lock */
+	unsigned int collect_formats;	/* cached by the last one, under collect_lock */
+	uint64_t collect_generation;	/* of those bodies, under collect_lock */
+};
+
+static struct nl80211_session session = { -1, 0, -1, -1, 0 };
+static struct shared_state *shared;
+
+/* Non-blocking netlink socket, subscribed to group unless that is 0 */
+static int nl_socket_open(int protocol, uint32_t group, int rcvbuf)
+{
+	union {
+		struct sockaddr sa;
+		struct sockaddr_nl nl;
+	} u;
+	int one = 1;
+
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, protocol);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&u, 0, sizeof(u));
+	u.nl.nl_family = AF_NETLINK;
+	if (rcvbuf) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+	/* Acks need not echo the whole request back */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	if (bind(fd, &u.sa, sizeof(u.nl)) ||
+	    (group && setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Zero is left to notifications */
+static uint32_t nl_next_seq(void)
+{
+	uint32_t seq = ++session.seq;
+	if (seq == 0) {
+		seq = ++session.seq;
+	}
+	return seq;
+}
+
+static int nl_send(int fd, const struct nlmsghdr *nlh)
+{
+	if (send(fd, nlh, nlh->nlmsg_len, 0) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/* One receive buffer serves all netlink sockets. It is never smaller than
+ * the 32 KiB the kernel packs dump replies into when the reader offers that
+ * much, and starts out at the largest datagram an earlier collection saw,
+ * so a worker does not have to learn that again. */
+#define NL_RX_MIN 32768
+
+static char *rx_buf;
+static size_t rx_size;
+
+/* Read one datagram into rx_buf, returns its length or a negative errno */
+static ssize_t nl_recv(int fd)
+{
+	size_t want = atomic_load(&shared->nl_rx_size);
+	if (want < NL_RX_MIN) {
+		want = NL_RX_MIN;
+	}
+	if (rx_size < want) {
+		char *p = realloc(rx_buf, want);
+		if (!p) {
+			return -ENOMEM;
+		}
+		rx_buf = p;
+		rx_size = want;
+	}
+
+	ssize_t n = recv(fd, rx_buf, rx_size, MSG_TRUNC);
+	if (n < 0) {
+		return -errno;
+	}
+	if ((size_t)n > rx_size) {
+		/* The rest of it is gone, but the next one will fit */
+		atomic_store(&shared->nl_rx_size, (size_t)n);
+		fprintf(stderr, "Netlink message of %zd bytes truncated.\n", n);
+		return -EMSGSIZE;
+	}
+	return n;
+}
+
+/* Replies of the collection currently running */
+static struct client_context *engine_ctx;
+static size_t engine_pending;
+
+static struct nl_request *worker_find(struct nl_worker *w, uint32_t seq)
+{
+	for (int i = 0; i < w->inflight; i++) {
+		if (w->req[i]->seq == seq) {
+			return w->req[i];
+		}
+	}
+	return NULL;
+}
+
+static void worker_complete(struct nl_worker *w, uint32_t seq, int err)
+{
+	for (int i = 0; i < w->inflight; i++) {
+		if (w->req[i]->seq == seq) {
+			if (w->req[i]->flags & NLM_F_DUMP) {
+				w->dumping = false;
+			}
+			w->req[i]->err = err;
+			w->req[i] = w->req[--w->inflight];
+			engine_pending--;
+			return;
+		}
+	}
+}
+
+/* Dispatch everything queued on the socket */
+static int worker_receive(struct nl_worker *w)
+{
+	for (;;) {
+		ssize_t n = nl_recv(w->fd);
+		if (n == -EAGAIN) {
+			return 0;
+		}
+		if (n < 0) {
+			return (int)n;
+		}
+		char *pos = rx_buf;
+		struct nlmsghdr *nlh;
+		while ((nlh = msg_next(&pos, rx_buf + n))) {
+			/* Anything else is left over from an earlier request on the socket */
+			struct nl_request *req = worker_find(w, nlh->nlmsg_seq);
+			if (!req) {
+				continue;
+			}
+			/* Dumps end with NLMSG_DONE, other requests with an ack */
+			if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR) {
+				worker_complete(w, nlh->nlmsg_seq, msg_error(nlh));
+			} else if (nlh->nlmsg_type >= NLMSG_MIN_TYPE) {
+				req->handler(nlh, engine_ctx);
+			}
+		}
+	}
+}
+
+static void worker_close(struct nl_worker *w)
+{
+	close(w->fd);
+	memset(w, 0, sizeof(*w));
+}
+
+static int worker_open(struct nl_worker *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = nl_socket_open(NETLINK_GENERIC, 0, 0);
+	return w->fd < 0 ? -ENOLINK : 0;
+}
+
+static void nl80211_disconnect(struct nl80211_session *s)
+{
+	if (s->events >= 0) {
+		close(s->events);
+	}
+	if (s->links >= 0) {
+		close(s->links);
+	}
+	for (int i = 0; i < s->workers; i++) {
+		worker_close(&s->worker[i]);
+	}
+	s->nl80211_id = -1;
+	s->mlme_group = 0;
+	s->events = -1;
+	s->links = -1;
+	s->workers = 0;
+}
+
+static void family_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct nl80211_session *s = arg;
+	const struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	size_t len;
+	const char *attrs = genl_attrs(nlh, &len);
+
+	attr_parse(tb, CTRL_ATTR_MAX, attrs, len);
+	if (tb[CTRL_ATTR_FAMILY_ID]) {
+		s->nl80211_id = attr_u16(tb[CTRL_ATTR_FAMILY_ID]);
+	}
+	if (!tb[CTRL_ATTR_MCAST_GROUPS]) {
+		return;
+	}
+	const char *pos = attr_data(tb[CTRL_ATTR_MCAST_GROUPS]);
+	const char *end = pos + attr_len(tb[CTRL_ATTR_MCAST_GROUPS]);
+	const struct nlattr *group;
+	while ((group = attr_next(&pos, end))) {
+		const struct nlattr *grp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+		char name[GENL_NAMSIZ];
+
+		attr_parse(grp, CTRL_ATTR_MCAST_GRP_MAX, attr_data(group), attr_len(group));
+		if (!grp[CTRL_ATTR_MCAST_GRP_NAME] || !grp[CTRL_ATTR_MCAST_GRP_ID]) {
+			continue;
+		}
+		attr_strlcpy(name, grp[CTRL_ATTR_MCAST_GRP_NAME], sizeof(name));
+		if (strcmp(name, "mlme") == 0) {
+			s->mlme_group = attr_u32(grp[CTRL_ATTR_MCAST_GRP_ID]);
+		}
+	}
+}
+
+/* Look up the nl80211 family and its mlme group in a single request */
+static int nl80211_resolve(struct nl80211_session *s)
+{
+	union nl_txbuf tx;
+	int fd = s->worker[0].fd;
+	uint32_t seq = nl_next_seq();
+	struct nlmsghdr *req = genl_put(&tx, GENL_ID_CTRL, 0, seq, CTRL_CMD_GETFAMILY);
+	attr_put(req, CTRL_ATTR_FAMILY_NAME, "nl80211", sizeof("nl80211"));
+
+	int rv = nl_send(fd, req);
+	bool done = false;
+	while (rv == 0 && !done) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int n = poll(&pfd, 1, 5000);
+		if (n == 0) {
+			rv = -ETIMEDOUT;
+			break;
+		} else if (n < 0) {
+			rv = errno == EINTR ? 0 : -errno;
+			continue;
+		}
+		ssize_t len;
+		while (!done && (len = nl_recv(fd)) > 0) {
+			char *pos = rx_buf;
+			struct nlmsghdr *nlh;
+			while ((nlh = msg_next(&pos, rx_buf + len))) {
+				if (nlh->nlmsg_seq != seq) {
+					continue;
+				}
+				if (nlh->nlmsg_type == NLMSG_ERROR) {
+					rv = msg_error(nlh);
+					done = true;
+				} else if (nlh->nlmsg_type == GENL_ID_CTRL) {
+					family_handler(nlh, s);
+				}
+			}
+		}
+		if (!done && len < 0 && len != -EAGAIN) {
+			rv = (int)len;
+		}
+	}
+	if (rv == 0 && s->nl80211_id < 0) {
+		rv = -ENOENT;
+	}
+	return rv;
+}
+
+static const struct field station_event_fields[] = {
+	[NL80211_ATTR_IFINDEX] = F_UINT(station_entry, ifindex, NO_BIT),
+	[NL80211_ATTR_MAC] = F_BYTES(station_entry, mac),
+};
+static const struct field_table station_event_table = FIELD_TABLE_NOMASK(station_event_fields);
+
+static void station_event_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct station_table *t = arg;
+	struct station_entry e;
+	uint8_t cmd = genl_cmd(nlh);
+	size_t len;
+	const char *attrs = genl_attrs(nlh, &len);
+
+	if (cmd != NL80211_CMD_NEW_STATION && cmd != NL80211_CMD_DEL_STATION) {
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	extract(&station_event_table, &e, attrs, len);
+	if (!e.ifindex) {
+		return;
+	}
+
+	if (cmd == NL80211_CMD_DEL_STATION) {
+		station_table_del(t, e.ifindex, e.mac);
+	} else if (station_table_add(t, e.ifindex, e.mac)) {
+		t->valid = false;
+	} else {
+		station_entry_label(station_table_find(t, e.ifindex, e.mac), ifname_get(e.ifindex, NULL));
+	}
+}
+
+/* Station add/remove notifications keep the station table current, so a
+ * collection only has to refresh the counters of known stations. */
+static void nl80211_subscribe(struct nl80211_session *s)
+{
+	if (!s->mlme_group) {
+		fprintf(stderr, "nl80211 mlme group not found, falling back to station dumps.\n");
+		return;
+	}
+	s->events = nl_socket_open(NETLINK_GENERIC, s->mlme_group, 262144);
+	if (s->events < 0) {
+		fprintf(stderr, "Failed to subscribe to nl80211 events, falling back to station dumps.\n");
+	}
+}
+
+static void links_subscribe(struct nl80211_session *s)
+{
+	s->links = nl_socket_open(NETLINK_ROUTE, RTNLGRP_LINK, 0);
+	if (s->links < 0) {
+		/* Without notifications a cached name could go stale */
+		fprintf(stderr, "Failed to subscribe to link events, not caching interface names.\n");
+	}
+}
+
+/* Apply all notifications queued on an event socket */
+static int events_receive(int fd, void (*handler)(const struct nlmsghdr *, void *), void *arg)
+{
+	for (;;) {
+		ssize_t n = nl_recv(fd);
+		if (n == -EAGAIN) {
+			return 0;
+		}
+		if (n < 0) {
+			return (int)n;
+		}
+		char *pos = rx_buf;
+		struct nlmsghdr *nlh;
+		while ((nlh = msg_next(&pos, rx_buf + n))) {
+			if (nlh->nlmsg_type >= NLMSG_MIN_TYPE) {
+				handler(nlh, arg);
+			}
+		}
+	}
+}
+
+/* Apply all pending station and link events */
+static void session_events_process(void)
+{
+	int rv;
+
+	if (session.events >= 0) {
+		rv = events_receive(session.events, station_event_handler, &stations);
+		if (rv < 0) {
+			/* Overflow or a broken socket, either way events were
+			 * lost and the table needs seeding again. */
+			fprintf(stderr, "Lost nl80211 station events: %s\n", strerror(-rv));
+			stations.valid = false;
+			if (rv != -ENOBUFS) {
+				session.broken = true;
+			}
+		}
+	}
+	if (session.links >= 0) {
+		rv = events_receive(session.links, link_event_handler, &ifnames);
+		if (rv < 0) {
+			fprintf(stderr, "Lost link events: %s\n", strerror(-rv));
+			ifname_clear(&ifnames);
+			if (rv != -ENOBUFS) {
+				session.broken = true;
+			}
+		}
+	} else {
+		ifname_clear(&ifnames);
+	}
+}
+
+/* Sockets session_events_process() wants to be called for */
+static int session_event_fds(int *fd)
+{
+	int n = 0;
+	if (session.events >= 0) {
+		fd[n++] = session.events;
+	}
+	if (session.links >= 0) {
+		fd[n++] = session.links;
+	}
+	return n;
+}
+
+static int nl80211_connect(struct nl80211_session *s)
+{
+	nl80211_disconnect(s);
+	for (int i = 0; i < NL_WORKERS; i++) {
+		if (worker_open(&s->worker[i])) {
+			fprintf(stderr, "Failed to open netlink socket.\n");
+			nl80211_disconnect(s);
+			return -ENOLINK;
+		}
+		s->workers++;
+	}
+	int rv = nl80211_resolve(s);
+	if (rv) {
+		fprintf(stderr, "nl80211 not found: %s\n", strerror(-rv));
+		nl80211_disconnect(s);
+		return rv;
+	}
+	/* Subscribe before seeding so no event falls in between */
+	station_table_clear(&stations);
+	ifname_clear(&ifnames);
+	nl80211_subscribe(s);
+	links_subscribe(s);
+	return 0;
+}
+
+/* Rendered scrape body shared by all request handlers. Scrapes within
+ * cache_window_ms of the last render get the same bytes back instead of
+ * collecting again. Pages are only committed once they are written to. */
+#define SCRAPE_CACHE_SIZE (4 << 20)
+
+struct scrape_cache {
+	pthread_mutex_t lock;
+	struct timespec rendered;	/* CLOCK_MONOTONIC */
+	uint64_t generation;		/* of the snapshot body was rendered from */
+	size_t len;			/* 0 while empty */
+	char body[SCRAPE_CACHE_SIZE];
+};
+
+/* There is a cache for every format. The gzip cache holds the compressed
+ * body of one snapshot, whichever handler needs it first compresses it
+ * for the others. Both are only mapped with -c or shared collections,
+ * without them no other worker sends the same snapshot. */
+static struct scrape_cache *cache[BODY_FORMATS];
+static struct scrape_cache *gzip_cache[BODY_FORMATS];
+static unsigned int cache_window_ms;
+/* Whether workers share the collections they make on demand */
+static bool share_collections;
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void *shared_alloc(size_t size)
+{
+	/* MAP_ANONYMOUS is not POSIX, a shared mapping of /dev/zero is */
+	int fd = open("/dev/zero", O_RDWR);
+	if (fd < 0) {
+		return NULL;
+	}
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void shared_mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static int shared_init(void)
+{
+	shared = shared_alloc(sizeof(*shared));
+	if (!shared) {
+		return -errno;
+	}
+	shared_mutex_init(&shared->generation_lock);
+	shared_mutex_init(&shared->collect_lock);
+	atomic_init(&shared->collections, 0);
+	atomic_init(&shared->formats_wanted, 0);
+	atomic_init(&shared->nl_rx_size, 0);
+
+	for (int i = 0; i < BODY_FORMATS; i++) {
+		if (cache_window_ms || share_collections) {
+			cache[i] = shared_alloc(sizeof(*cache[i]));
+			if (!cache[i]) {
+				return -errno;
+			}
+			shared_mutex_init(&cache[i]->lock);
+			gzip_cache[i] = shared_alloc(sizeof(*gzip_cache[i]));
+			if (!gzip_cache[i]) {
+				return -errno;
+			}
+			shared_mutex_init(&gzip_cache[i]->lock);
+		}
+	}
+	return 0;
+}
+
+/* Generations order collections of all workers */
+static uint64_t generation_next(void)
+{
+	if (pthread_mutex_lock(&shared->generation_lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&shared->generation_lock);
+	}
+	uint64_t generation = ++shared->generation;
+	pthread_mutex_unlock(&shared->generation_lock);
+	return generation;
+}
+
+static size_t iface_slot(const struct snapshot *snap, uint32_t ifindex)
+{
+	size_t i = (ifindex * 2654435761u) & snap->if_mask;
+	while (snap->if_index[i] && snap->iface[snap->if_index[i] - 1].ifindex != ifindex) {
+		i = (i + 1) & snap->if_mask;
+	}
+	return i;
+}
+
+static int find_iface(const struct snapshot *snap, uint32_t ifindex)
+{
+	if (!snap->if_index) {
+		return -1;
+	}
+	return snap->if_index[iface_slot(snap, ifindex)] - 1;
+}
+
+static struct interface_info *iface_add(struct snapshot *snap, uint32_t ifindex)
+{
+	/* Keep the index at most half full */
+	if (!snap->if_index || ((size_t)snap->if_count + 1) * 2 > snap->if_mask + 1) {
+		size_t slots = snap->if_index ? (snap->if_mask + 1) * 2 : 32;
+		int *index = calloc(slots, sizeof(*index));
+		if (!index) {
+			return NULL;
+		}
+		free(snap->if_index);
+		snap->if_index = index;
+		snap->if_mask = slots - 1;
+		for (int i = 0; i < snap->if_count; i++) {
+			snap->if_index[iface_slot(snap, snap->iface[i].ifindex)] = i + 1;
+		}
+	}
+
+	size_t slot = iface_slot(snap, ifindex);
+	if (snap->if_index[slot]) {
+		return &snap->iface[snap->if_index[slot] - 1];
+	}
+	void *p = array_grow(snap->iface, &snap->if_alloc, (size_t)snap->if_count, sizeof(*snap->iface));
+	if (!p) {
+		return NULL;
+	}
+	snap->iface = p;
+	struct interface_info *iface = &snap->iface[snap->if_count];
+	memset(iface, 0, sizeof(*iface));
+	iface->ifindex = ifindex;
+	snap->if_index[slot] = ++snap->if_count;
+	return iface;
+}
+
+/* Channel surveys belong to the radio, so they are only collected through
+ * the first interface of every wiphy */
+static bool first_on_radio(const struct snapshot *snap, int pos)
+{
+	for (int i = 0; i < pos; i++) {
+		if (snap->iface[i].wiphy == snap->iface[pos].wiphy) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static const struct field survey_fields[] = {
+	[NL80211_SURVEY_INFO_FREQUENCY] = F_UINT(survey_info, frequency, NL80211_SURVEY_INFO_FREQUENCY),
+	[NL80211_SURVEY_INFO_NOISE] = F_UINT(survey_info, noise, NL80211_SURVEY_INFO_NOISE),
+	[NL80211_SURVEY_INFO_IN_USE] = F_BOOL(survey_info, in_use, NL80211_SURVEY_INFO_IN_USE),
+	[NL80211_SURVEY_INFO_CHANNEL_TIME] = F_UINT(survey_info, time, NL80211_SURVEY_INFO_CHANNEL_TIME),
+	[NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY] = F_UINT(survey_info, time_busy, NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY),
+	[NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY] = F_UINT(survey_info, time_ext_busy, NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY),
+	[NL80211_SURVEY_INFO_CHANNEL_TIME_RX] = F_UINT(survey_info, time_rx, NL80211_SURVEY_INFO_CHANNEL_TIME_RX),
+	[NL80211_SURVEY_INFO_CHANNEL_TIME_TX] = F_UINT(survey_info, time_tx, NL80211_SURVEY_INFO_CHANNEL_TIME_TX),
+};
+static const struct field_table survey_table = FIELD_TABLE(survey_fields, survey_info);
+
+static const struct field survey_msg_fields[] = {
+	[NL80211_ATTR_IFINDEX] = F_UINT(survey_info, ifindex, NO_BIT),
+	[NL80211_ATTR_SURVEY_INFO] = F_INLINE(survey_table),
+};
+static const struct field_table survey_msg_table = FIELD_TABLE_NOMASK(survey_msg_fields);
+
+static void survey_dump_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct client_context *ctx = (struct client_context *)arg;
+	struct snapshot *snap = ctx->snap;
+	size_t len;
+	const char *attrs = genl_attrs(nlh, &len);
+
+	void *p = array_grow(snap->survey, &snap->survey_alloc, snap->survey_count, sizeof(*snap->survey));
+	if (!p) {
+		fprintf(stderr, "Failed to allocate survey entry.\n");
+		return;
+	}
+	snap->survey = p;
+	struct survey_info *survey = &snap->survey[snap->survey_count];
+	memset(survey, 0, sizeof(*survey));
+	extract(&survey_msg_table, survey, attrs, len);
+
+	if (!survey->present) {
+		fprintf(stderr, "survey data missing!\n");
+		return;
+	}
+	if (!(survey->present & BIT(NL80211_SURVEY_INFO_FREQUENCY)) || !survey->ifindex) {
+		return;
+	}
+	survey->iface = find_iface(snap, survey->ifindex);
+	if (survey->iface == -1) {
+		return;
+	}
+	snap->survey_count++;
+}
+
+static const struct field bss_fields[] = {
+	[NL80211_STA_BSS_PARAM_CTS_PROT] = F_FLAG(NL80211_STA_BSS_PARAM_CTS_PROT),
+	[NL80211_STA_BSS_PARAM_SHORT_PREAMBLE] = F_FLAG(NL80211_STA_BSS_PARAM_SHORT_PREAMBLE),
+	[NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME] = F_FLAG(NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME),
+	[NL80211_STA_BSS_PARAM_DTIM_PERIOD] = F_UINT(bss_param, dtim_period, NL80211_STA_BSS_PARAM_DTIM_PERIOD),
+	[NL80211_STA_BSS_PARAM_BEACON_INTERVAL] = F_UINT(bss_param, beacon_interval, NL80211_STA_BSS_PARAM_BEACON_INTERVAL),
+};
+static const struct field_table bss_table = FIELD_TABLE(bss_fields, bss_param);
+
+static const struct field tid_fields[] = {
+	[NL80211_TID_STATS_RX_MSDU] = F_UINT(tid_stats, rx_msdu, NL80211_TID_STATS_RX_MSDU),
+	[NL80211_TID_STATS_TX_MSDU] = F_UINT(tid_stats, tx_msdu, NL80211_TID_STATS_TX_MSDU),
+	[NL80211_TID_STATS_TX_MSDU_RETRIES] = F_UINT(tid_stats, tx_msdu_retries, NL80211_TID_STATS_TX_MSDU_RETRIES),
+	[NL80211_TID_STATS_TX_MSDU_FAILED] = F_UINT(tid_stats, tx_msdu_failed, NL80211_TID_STATS_TX_MSDU_FAILED),
+};
+static const struct field_table tid_table = FIELD_TABLE(tid_fields, tid_stats);
+
+/* The 32 bit bitrate comes first, the 16 bit one is only a fallback.
+ * FIXME: 80+80 is reported as 160, there is no way of telling the
+ * controller yet. But then again.. nobody should be using 160MHz wide
+ * channels anyway */
+static const struct field rate_fields[] = {
+	[NL80211_RATE_INFO_BITRATE] = F_WEAK_UINT(rate_info, bitrate, NL80211_RATE_INFO_BITRATE),
+	[NL80211_RATE_INFO_BITRATE32] = F_UINT(rate_info, bitrate, NL80211_RATE_INFO_BITRATE),
+	[NL80211_RATE_INFO_MCS] = F_UINT(rate_info, mcs, NL80211_RATE_INFO_MCS),
+	[NL80211_RATE_INFO_VHT_MCS] = F_UINT(rate_info, vht_mcs, NL80211_RATE_INFO_VHT_MCS),
+	[NL80211_RATE_INFO_VHT_NSS] = F_UINT(rate_info, vht_nss, NL80211_RATE_INFO_VHT_NSS),
+	[NL80211_RATE_INFO_SHORT_GI] = F_BOOL(rate_info, short_gi, NO_BIT),
+	[NL80211_RATE_INFO_40_MHZ_WIDTH] = F_WIDTH(rate_info, channel_width, 40),
+	[NL80211_RATE_INFO_80_MHZ_WIDTH] = F_WIDTH(rate_info, channel_width, 80),
+	[NL80211_RATE_INFO_80P80_MHZ_WIDTH] = F_WIDTH(rate_info, channel_width, 160),
+	[NL80211_RATE_INFO_160_MHZ_WIDTH] = F_WIDTH(rate_info, channel_width, 160),
+};
+static const struct field_table rate_table = FIELD_TABLE(rate_fields, rate_info);
+
+static uint8_t chain_list(const struct nlattr *attr_list, int8_t *chain)
+{
+	const struct nlattr *attr;
+	const char *pos = attr_data(attr_list);
+	const char *end = pos + attr_len(attr_list);
+	uint8_t i = 0;
+
+	while (i < MAX_CHAINS && (attr = attr_next(&pos, end))) {
+		chain[i++] = (int8_t)attr_u8(attr);
+	}
+	return i;
+}
+
+static void parse_chain_signal(const struct nlattr *attr, void *rec)
+{
+	struct station_info *sta = rec;
+	sta->chains = chain_list(attr, sta->chain_signal);
+}
+
+static void parse_chain_signal_avg(const struct nlattr *attr, void *rec)
+{
+	struct station_info *sta = rec;
+	sta->chains_avg = chain_list(attr, sta->chain_signal_avg);
+}
+
+static void parse_tid_stats(const struct nlattr *tid_stats_attr, void *rec)
+{
+	struct station_info *sta = rec;
+	const struct nlattr *tidattr;
+	const char *pos = attr_data(tid_stats_attr);
+	const char *end = pos + attr_len(tid_stats_attr);
+
+	while (sta->tids < MAX_TIDS && (tidattr = attr_next(&pos, end))) {
+		extract(&tid_table, &sta->tid[sta->tids++], attr_data(tidattr), attr_len(tidattr));
+	}
+}
+
+static void parse_sta_flags(const struct nlattr *attr, void *rec)
+{
+	struct station_info *sta = rec;
+	struct nl80211_sta_flag_update sta_flags = {0};
+
+	attr_copy(attr, &sta_flags, sizeof(sta_flags));
+	sta->sta_flags = sta_flags.set;
+}
+
+/* The 64 bit byte counters win over the 32 bit ones whichever comes first */
+static const struct field station_fields[] = {
+	[NL80211_STA_INFO_CONNECTED_TIME] = F_UINT(station_info, connected_time, NL80211_STA_INFO_CONNECTED_TIME),
+	[NL80211_STA_INFO_INACTIVE_TIME] = F_UINT(station_info, inactive_time, NL80211_STA_INFO_INACTIVE_TIME),
+	[NL80211_STA_INFO_RX_BYTES] = F_WEAK_UINT(station_info, rx_bytes, NL80211_STA_INFO_RX_BYTES),
+	[NL80211_STA_INFO_RX_BYTES64] = F_UINT(station_info, rx_bytes, NL80211_STA_INFO_RX_BYTES),
+	[NL80211_STA_INFO_TX_BYTES] = F_WEAK_UINT(station_info, tx_bytes, NL80211_STA_INFO_TX_BYTES),
+	[NL80211_STA_INFO_TX_BYTES64] = F_UINT(station_info, tx_bytes, NL80211_STA_INFO_TX_BYTES),
+	[NL80211_STA_INFO_RX_PACKETS] = F_UINT(station_info, rx_packets, NL80211_STA_INFO_RX_PACKETS),
+	[NL80211_STA_INFO_TX_PACKETS] = F_UINT(station_info, tx_packets, NL80211_STA_INFO_TX_PACKETS),
+	[NL80211_STA_INFO_TX_RETRIES] = F_UINT(station_info, tx_retries, NL80211_STA_INFO_TX_RETRIES),
+	[NL80211_STA_INFO_TX_FAILED] = F_UINT(station_info, tx_failed, NL80211_STA_INFO_TX_FAILED),
+	[NL80211_STA_INFO_BEACON_LOSS] = F_UINT(station_info, beacon_loss, NL80211_STA_INFO_BEACON_LOSS),
+	[NL80211_STA_INFO_BEACON_RX] = F_UINT(station_info, rx_beacons, NL80211_STA_INFO_BEACON_RX),
+	[NL80211_STA_INFO_RX_DROP_MISC] = F_UINT(station_info, rx_drop_misc, NL80211_STA_INFO_RX_DROP_MISC),
+	[NL80211_STA_INFO_SIGNAL] = F_UINT(station_info, signal, NL80211_STA_INFO_SIGNAL),
+	[NL80211_STA_INFO_SIGNAL_AVG] = F_UINT(station_info, signal_avg, NL80211_STA_INFO_SIGNAL_AVG),
+	[NL80211_STA_INFO_BEACON_SIGNAL_AVG] = F_UINT(station_info, beacon_signal_avg, NL80211_STA_INFO_BEACON_SIGNAL_AVG),
+	[NL80211_STA_INFO_T_OFFSET] = F_UINT(station_info, t_offset, NL80211_STA_INFO_T_OFFSET),
+	[NL80211_STA_INFO_RX_DURATION] = F_UINT(station_info, rx_duration, NL80211_STA_INFO_RX_DURATION),
+	[NL80211_STA_INFO_EXPECTED_THROUGHPUT] = F_UINT(station_info, expected_throughput, NL80211_STA_INFO_EXPECTED_THROUGHPUT),
+	[NL80211_STA_INFO_TX_BITRATE] = F_NESTED(station_info, tx_rate, NL80211_STA_INFO_TX_BITRATE, rate_table),
+	[NL80211_STA_INFO_RX_BITRATE] = F_NESTED(station_info, rx_rate, NL80211_STA_INFO_RX_BITRATE, rate_table),
+	[NL80211_STA_INFO_BSS_PARAM] = F_NESTED(station_info, bss, NO_BIT, bss_table),
+	[NL80211_STA_INFO_CHAIN_SIGNAL] = F_CALL(NO_BIT, parse_chain_signal),
+	[NL80211_STA_INFO_CHAIN_SIGNAL_AVG] = F_CALL(NO_BIT, parse_chain_signal_avg),
+	[NL80211_STA_INFO_TID_STATS] = F_CALL(NO_BIT, parse_tid_stats),
+	[NL80211_STA_INFO_STA_FLAGS] = F_CALL(NL80211_STA_INFO_STA_FLAGS, parse_sta_flags),
+};
+static const struct field_table station_table = FIELD_TABLE(station_fields, station_info);
+
+static const struct field station_msg_fields[] = {
+	[NL80211_ATTR_IFINDEX] = F_UINT(station_info, ifindex, NO_BIT),
+	[NL80211_ATTR_MAC] = F_BYTES(station_info, mac),
+	[NL80211_ATTR_STA_INFO] = F_INLINE(station_table),
+};
+static const struct field_table station_msg_table = FIELD_TABLE_NOMASK(station_msg_fields);
+
+/* Each column is grown to the same number of rows, alloc only moves once
+ * all of them made it */
+static int station_columns_grow(struct station_columns *c)
+{
+	if (c->count < c->alloc) {
+		return 0;
+	}
+	size_t n = c->alloc ? c->alloc * 2 : 16;
+
+#define GROW(col) do { \
+		void *p = realloc(c->col, n * sizeof(*c->col)); \
+		if (!p) { \
+			return -ENOMEM; \
+		} \
+		c->col = p; \
+	} while (0)
+
+	GROW(iface);
+	GROW(mac);
+	GROW(label);
+	GROW(label_len);
+	GROW(has);
+	for (int i = 0; i < STATION_COLUMNS; i++) {
+		GROW(value[i]);
+	}
+	GROW(chains);
+	GROW(chain_signal);
+	GROW(chains_avg);
+	GROW(chain_signal_avg);
+	GROW(tids);
+	GROW(tid);
+	GROW(blob);
+#undef GROW
+	c->alloc = n;
+	return 0;
+}
+
+#define COL_PUT(c, row, has, cond, col, v) do { \
+		if (cond) { \
+			(has) |= BIT(col); \
+			(c)->value[col][row] = (uint64_t)(v); \
+		} \
+	} while (0)
+
+/* The six rate columns follow each other, first is the bitrate one */
+static uint64_t station_columns_put_rate(struct station_columns *c, size_t row, const struct rate_info *rate, int first)
+{
+	uint64_t has = 0;
+
+	COL_PUT(c, row, has, rate->present & BIT(NL80211_RATE_INFO_BITRATE), first, (uint64_t)rate->bitrate * 100000);
+	COL_PUT(c, row, has, rate->present & BIT(NL80211_RATE_INFO_MCS), first + 1, rate->mcs);
+	COL_PUT(c, row, has, rate->present & BIT(NL80211_RATE_INFO_VHT_MCS), first + 2, rate->vht_mcs);
+	COL_PUT(c, row, has, true, first + 3, rate->channel_width);
+	COL_PUT(c, row, has, true, first + 4, rate->short_gi);
+	COL_PUT(c, row, has, rate->present & BIT(NL80211_RATE_INFO_VHT_NSS), first + 5, rate->vht_nss);
+	return has;
+}
+
+/* Scatter a parsed station over the columns */
+static int station_columns_append(struct station_columns *c, const struct station_info *sta,
+		const char *label, size_t label_len)
+{
+	if (station_columns_grow(c)) {
+		return -ENOMEM;
+	}
+	size_t row = c->count;
+	uint64_t p = sta->present;
+	uint64_t has = 0;
+
+	c->iface[row] = sta->iface;
+	memcpy(c->mac[row], sta->mac, ETH_ALEN);
+	memcpy(c->label[row], label, label_len);
+	c->label_len[row] = (uint8_t)label_len;
+
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_CONNECTED_TIME), COL_CONNECTED_TIME, sta->connected_time);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_INACTIVE_TIME), COL_INACTIVE_TIME, sta->inactive_time);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_RX_BYTES), COL_RX_BYTES, sta->rx_bytes);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_RX_PACKETS), COL_RX_PACKETS, sta->rx_packets);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_TX_BYTES), COL_TX_BYTES, sta->tx_bytes);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_TX_PACKETS), COL_TX_PACKETS, sta->tx_packets);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_TX_RETRIES), COL_TX_RETRIES, sta->tx_retries);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_TX_FAILED), COL_TX_FAILED, sta->tx_failed);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_BEACON_LOSS), COL_BEACON_LOSS, sta->beacon_loss);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_BEACON_RX), COL_RX_BEACONS, sta->rx_beacons);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_RX_DROP_MISC), COL_RX_DROP_MISC, sta->rx_drop_misc);
+	/* Signed values are stored two's complement, the family says how to print them */
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_SIGNAL), COL_SIGNAL, (int64_t)sta->signal);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_SIGNAL_AVG), COL_SIGNAL_AVG, (int64_t)sta->signal_avg);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_BEACON_SIGNAL_AVG), COL_BEACON_SIGNAL_AVG, (int64_t)sta->beacon_signal_avg);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_T_OFFSET), COL_T_OFFSET, sta->t_offset);
+	if (p & BIT(NL80211_STA_INFO_TX_BITRATE)) {
+		has |= station_columns_put_rate(c, row, &sta->tx_rate, COL_TX_BITRATE);
+	}
+	if (p & BIT(NL80211_STA_INFO_RX_BITRATE)) {
+		has |= station_columns_put_rate(c, row, &sta->rx_rate, COL_RX_BITRATE);
+	}
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_RX_DURATION), COL_RX_DURATION, sta->rx_duration);
+	COL_PUT(c, row, has, p & BIT(NL80211_STA_INFO_EXPECTED_THROUGHPUT), COL_EXPECTED_THROUGHPUT, (uint64_t)sta->expected_throughput * 1000);
+
+	bool flags = p & BIT(NL80211_STA_INFO_STA_FLAGS);
+	COL_PUT(c, row, has, flags, COL_AUTHORIZED, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_AUTHORIZED)));
+	COL_PUT(c, row, has, flags, COL_AUTHENTICATED, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_AUTHENTICATED)));
+	COL_PUT(c, row, has, flags, COL_ASSOCIATED, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_ASSOCIATED)));
+	COL_PUT(c, row, has, flags, COL_SHORT_PREAMBLE, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_SHORT_PREAMBLE)));
+	COL_PUT(c, row, has, flags, COL_WME, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_WME)));
+	COL_PUT(c, row, has, flags, COL_MFP, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_MFP)));
+	COL_PUT(c, row, has, flags, COL_TDLS_PEER, !!(sta->sta_flags & BIT(NL80211_STA_FLAG_TDLS_PEER)));
+
+	uint32_t bss = sta->bss.present;
+	COL_PUT(c, row, has, bss & BIT(NL80211_STA_BSS_PARAM_DTIM_PERIOD), COL_BSS_DTIM_PERIOD, sta->bss.dtim_period);
+	COL_PUT(c, row, has, bss & BIT(NL80211_STA_BSS_PARAM_BEACON_INTERVAL), COL_BSS_BEACON_INTERVAL, sta->bss.beacon_interval);
+	COL_PUT(c, row, has, bss & BIT(NL80211_STA_BSS_PARAM_CTS_PROT), COL_BSS_CTS_PROTECTION, 1);
+	COL_PUT(c, row, has, bss & BIT(NL80211_STA_BSS_PARAM_SHORT_PREAMBLE), COL_BSS_SHORT_PREAMBLE, 1);
+	COL_PUT(c, row, has, bss & BIT(NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME), COL_BSS_SHORT_SLOT_TIME, 1);
+	c->has[row] = has;
+
+	c->chains[row] = sta->chains;
+	memcpy(c->chain_signal[row], sta->chain_signal, sizeof(sta->chain_signal));
+	c->chains_avg[row] = sta->chains_avg;
+	memcpy(c->chain_signal_avg[row], sta->chain_signal_avg, sizeof(sta->chain_signal_avg));
+	c->tids[row] = sta->tids;
+	memcpy(c->tid[row], sta->tid, sizeof(sta->tid));
+	c->blob[row] = NULL;
+	c->count++;
+	return 0;
+}
+
+static void station_dump_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct client_context *ctx = (struct client_context *)arg;
+	struct snapshot *snap = ctx->snap;
+	size_t len;
+	const char *attrs = genl_attrs(nlh, &len);
+
+	struct station_info info;
+	struct station_info *sta = &info;
+
+	memset(sta, 0, sizeof(*sta));
+	extract(&station_msg_table, sta, attrs, len);
+
+	if (!sta->present) {
+		fprintf(stderr, "sta stats missing!\n");
+		return;
+	}
+	if (!sta->ifindex) {
+		return;
+	}
+	sta->iface = find_iface(snap, sta->ifindex);
+	if (sta->iface == -1) {
+		fprintf(stderr, "Failed to find this interface in the context.\n");
+		return;
+	}
+	/* Without a width flag the channel is 20 MHz wide */
+	if (!sta->tx_rate.channel_width) {
+		sta->tx_rate.channel_width = 20;
+	}
+	if (!sta->rx_rate.channel_width) {
+		sta->rx_rate.channel_width = 20;
+	}
+	/* Known stations keep their label block between collections */
+	const char *dev = snap->iface[sta->iface].name;
+	struct station_entry *e = station_table_find(&stations, sta->ifindex, sta->mac);
+	char buf[STATION_LABEL_SIZE];
+	const char *label = buf;
+	size_t label_len;
+	if (e) {
+		label_len = station_entry_label(e, dev);
+		label = e->label;
+	} else {
+		label_len = station_label(buf, dev, sta->mac);
+	}
+	if (station_columns_append(&snap->sta, sta, label, label_len)) {
+		fprintf(stderr, "Failed to allocate station entry.\n");
+		return;
+	}
+	snap->iface[sta->iface].num_sta++;
+}
+
+/* The name is looked up through the cache, nl80211 only provides it for
+ * interfaces the cache has not seen yet */
+struct interface_msg {
+	struct interface_info info;
+	const struct nlattr *name;
+};
+
+static const struct field interface_msg_fields[] = {
+	[NL80211_ATTR_WIPHY] = F_UINT(interface_msg, info.wiphy, NO_BIT),
+	[NL80211_ATTR_IFINDEX] = F_UINT(interface_msg, info.ifindex, NO_BIT),
+	[NL80211_ATTR_IFNAME] = F_ATTR(interface_msg, name),
+	[NL80211_ATTR_IFTYPE] = F_UINT(interface_msg, info.iftype, NO_BIT),
+	[NL80211_ATTR_WIPHY_TX_POWER_LEVEL] = F_UINT(interface_msg, info.tx_power, IFACE_TX_POWER),
+};
+static const struct field_table interface_msg_table = {
+	interface_msg_fields, (int)ARRAY_SIZE(interface_msg_fields) - 1,
+	offsetof(struct interface_msg, info.present), sizeof(((struct interface_msg *)0)->info.present)
+};
+
+static void list_interface_handler(const struct nlmsghdr *nlh, void *arg)
+{
+	struct client_context *ctx = (struct client_context *)arg;
+	struct snapshot *snap = ctx->snap;
+	struct interface_msg msg;
+	size_t len;
+	const char *attrs = genl_attrs(nlh, &len);
+
+	memset(&msg, 0, sizeof(msg));
+	extract(&interface_msg_table, &msg, attrs, len);
+	if (!msg.info.ifindex) {
+		return;
+	}
+	struct interface_info *iface = iface_add(snap, msg.info.ifindex);
+	if (!iface) {
+		fprintf(stderr, "Failed to allocate interface entry.\n");
+		return;
+	}
+	*iface = msg.info;
+	iface->name = ifname_get(iface->ifindex, msg.name);
+}
+
+/* Output is rendered into an arena that is kept and reused between scrapes */
+struct arena {
+	char *buf;
+	size_t len;
+	size_t alloc;
+	bool failed;		/* something did not fit, the output is incomplete */
+};
+
+/* Room for n more bytes at buf + len, NULL if it could not be made */
+static char *arena_reserve(struct arena *a, size_t n)
+{
+	if (a->len + n > a->alloc) {
+		size_t alloc = a->alloc ? a->alloc : 4096;
+		while (alloc < a->len + n) {
+			alloc *= 2;
+		}
+		void *p = realloc(a->buf, alloc);
+		if (!p) {
+			a->failed = true;
+			return NULL;
+		}
+		a->buf = p;
+		a->alloc = alloc;
+	}
+	return a->buf + a->len;
+}
+
+static void arena_put(struct arena *a, const void *data, size_t n)
+{
+	char *p = arena_reserve(a, n);
+	if (p) {
+		memcpy(p, data, n);
+		a->len += n;
+	}
+}
+
+static void arena_puts(struct arena *a, const char *str)
+{
+	arena_put(a, str, strlen(str));
+}
+
+__attribute__((format(printf, 2, 3)))
+static void arena_printf(struct arena *a, const char *fmt, ...)
+{
+	va_list ap;
+	char *p = arena_reserve(a, 128);
+	if (!p) {
+		return;
+	}
+	va_start(ap, fmt);
+	int n = vsnprintf(p, a->alloc - a->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		a->failed = true;
+		return;
+	}
+	if ((size_t)n >= a->alloc - a->len) {
+		if (!(p = arena_reserve(a, (size_t)n + 1))) {
+			return;
+		}
+		va_start(ap, fmt);
+		vsnprintf(p, (size_t)n + 1, fmt, ap);
+		va_end(ap);
+	}
+	a->len += (size_t)n;
+}
+
+/* Samples of a family are rendered together, behind a single HELP and TYPE */
+struct metric_family {
+	const char *name;
+	const char *type;
+	const char *help;
+	bool is_signed;
+};
+
+#define GAUGE(n, h) { n, "gauge", h, false }
+#define SIGNED_GAUGE(n, h) { n, "gauge", h, true }
+#define COUNTER(n, h) { n, "counter", h, false }
+
+static const struct metric_family tx_power_family =
+	GAUGE("wlan_interface_tx_power_dbm", "Transmit power of the interface in dBm");
+static const struct metric_family num_stations_family =
+	GAUGE("wlan_num_stations", "Number of stations associated to the interface");
+
+static const struct metric_family station_families[STATION_COLUMNS] = {
+	[COL_CONNECTED_TIME] = GAUGE("wlan_station_connected_time_s", "Time since the station connected in seconds"),
+	[COL_INACTIVE_TIME] = GAUGE("wlan_station_inactive_time_ms", "Time since the last activity of the station in milliseconds"),
+	[COL_RX_BYTES] = COUNTER("wlan_station_rx_bytes", "Bytes received from the station"),
+	[COL_RX_PACKETS] = COUNTER("wlan_station_rx_packets", "Packets received from the station"),
+	[COL_TX_BYTES] = COUNTER("wlan_station_tx_bytes", "Bytes transmitted to the station"),
+	[COL_TX_PACKETS] = COUNTER("wlan_station_tx_packets", "Packets transmitted to the station"),
+	[COL_TX_RETRIES] = COUNTER("wlan_station_tx_retries", "Retries of transmissions to the station"),
+	[COL_TX_FAILED] = COUNTER("wlan_station_tx_failed", "Failed transmissions to the station"),
+	[COL_BEACON_LOSS] = COUNTER("wlan_station_beacon_loss", "Beacons lost from the station"),
+	[COL_RX_BEACONS] = COUNTER("wlan_station_rx_beacons", "Beacons received from the station"),
+	[COL_RX_DROP_MISC] = COUNTER("wlan_station_rx_drop_misc", "Frames from the station dropped for unspecified reasons"),
+	[COL_SIGNAL] = SIGNED_GAUGE("wlan_station_signal_dbm", "Signal strength of the last frame in dBm"),
+	[COL_SIGNAL_AVG] = SIGNED_GAUGE("wlan_station_signal_avg_dbm", "Average signal strength in dBm"),
+	[COL_BEACON_SIGNAL_AVG] = SIGNED_GAUGE("wlan_station_beacon_signal_avg_dbm", "Average beacon signal strength in dBm"),
+	[COL_T_OFFSET] = SIGNED_GAUGE("wlan_station_time_offset_ms", "Timing offset to the station"),
+	[COL_TX_BITRATE] = GAUGE("wlan_station_tx_bitrate", "Transmit bitrate in bit/s"),
+	[COL_TX_MCS] = GAUGE("wlan_station_tx_bitrate_mcs", "Transmit HT MCS index"),
+	[COL_TX_VHT_MCS] = GAUGE("wlan_station_tx_bitrate_vht_mcs", "Transmit VHT MCS index"),
+	[COL_TX_CHANNEL_WIDTH] = GAUGE("wlan_station_tx_bitrate_channel_width", "Transmit channel width in MHz"),
+	[COL_TX_SHORT_GI] = GAUGE("wlan_station_tx_bitrate_short_gi", "Whether transmissions use a short guard interval"),
+	[COL_TX_VHT_NSS] = GAUGE("wlan_station_tx_bitrate_vht_nss", "Transmit VHT spatial streams"),
+	[COL_RX_BITRATE] = GAUGE("wlan_station_rx_bitrate", "Receive bitrate in bit/s"),
+	[COL_RX_MCS] = GAUGE("wlan_station_rx_bitrate_mcs", "Receive HT MCS index"),
+	[COL_RX_VHT_MCS] = GAUGE("wlan_station_rx_bitrate_vht_mcs", "Receive VHT MCS index"),
+	[COL_RX_CHANNEL_WIDTH] = GAUGE("wlan_station_rx_bitrate_channel_width", "Receive channel width in MHz"),
+	[COL_RX_SHORT_GI] = GAUGE("wlan_station_rx_bitrate_short_gi", "Whether receptions use a short guard interval"),
+	[COL_RX_VHT_NSS] = GAUGE("wlan_station_rx_bitrate_vht_nss", "Receive VHT spatial streams"),
+	[COL_RX_DURATION] = COUNTER("wlan_station_rx_duration", "Time spent receiving from the station in microseconds"),
+	[COL_EXPECTED_THROUGHPUT] = GAUGE("wlan_station_expected_throughput", "Expected throughput to the station in bit/s"),
+	[COL_AUTHORIZED] = GAUGE("wlan_station_authorized", "Whether the station is authorized"),
+	[COL_AUTHENTICATED] = GAUGE("wlan_station_authenticated", "Whether the station is authenticated"),
+	[COL_ASSOCIATED] = GAUGE("wlan_station_associated", "Whether the station is associated"),
+	[COL_SHORT_PREAMBLE] = GAUGE("wlan_station_short_preamble", "Whether the station uses short preambles"),
+	[COL_WME] = GAUGE("wlan_station_wme", "Whether the station supports WME"),
+	[COL_MFP] = GAUGE("wlan_station_mfp", "Whether the station uses management frame protection"),
+	[COL_TDLS_PEER] = GAUGE("wlan_station_tdls_peer", "Whether the station is a TDLS peer"),
+	[COL_BSS_DTIM_PERIOD] = GAUGE("wlan_station_bss_dtim_period", "DTIM period of the BSS"),
+	[COL_BSS_BEACON_INTERVAL] = GAUGE("wlan_station_bss_beacon_interval", "Beacon interval of the BSS"),
+	[COL_BSS_CTS_PROTECTION] = GAUGE("wlan_station_bss_cts_protection", "Whether the BSS uses CTS protection"),
+	[COL_BSS_SHORT_PREAMBLE] = GAUGE("wlan_station_bss_short_preamble", "Whether the BSS uses short preambles"),
+	[COL_BSS_SHORT_SLOT_TIME] = GAUGE("wlan_station_bss_short_slot_time", "Whether the BSS uses short slot times"),
+};
+
+static const struct metric_family chain_families[] = {
+	SIGNED_GAUGE("wlan_station_chain_signal_dbm", "Signal strength of the last frame per chain in dBm"),
+	SIGNED_GAUGE("wlan_station_chain_signal_avg_dbm", "Average signal strength per chain in dBm"),
+};
+
+static const struct {
+	uint8_t bit;
+	struct metric_family family;
+} tid_families[] = {
+	{ NL80211_TID_STATS_RX_MSDU, COUNTER("wlan_station_tid_rx_msdu", "MSDUs received per TID") },
+	{ NL80211_TID_STATS_TX_MSDU, COUNTER("wlan_station_tid_tx_msdu", "MSDUs transmitted per TID") },
+	{ NL80211_TID_STATS_TX_MSDU_RETRIES, COUNTER("wlan_station_tid_tx_msdu_retries", "MSDU transmission retries per TID") },
+	{ NL80211_TID_STATS_TX_MSDU_FAILED, COUNTER("wlan_station_tid_tx_msdu_failed", "Failed MSDU transmissions per TID") },
+};
+
+/* Every survey value is rendered for each channel and again for the one in use */
+static const struct {
+	uint8_t bit;
+	struct metric_family channel;
+	struct metric_family active;
+} survey_families[] = {
+	{ NL80211_SURVEY_INFO_NOISE,
+		SIGNED_GAUGE("wlan_survey_channel_noise_dbm", "Noise level of the channel in dBm"),
+		SIGNED_GAUGE("wlan_active_channel_noise_dbm", "Noise level of the channel in use in dBm") },
+	{ NL80211_SURVEY_INFO_CHANNEL_TIME,
+		COUNTER("wlan_survey_channel_active_ms", "Time the radio spent on the channel in milliseconds"),
+		COUNTER("wlan_active_channel_active_ms", "Time the radio spent on the channel in use in milliseconds") },
+	{ NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY,
+		COUNTER("wlan_survey_channel_busy_ms", "Time the channel was busy in milliseconds"),
+		COUNTER("wlan_active_channel_busy_ms", "Time the channel in use was busy in milliseconds") },
+	{ NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY,
+		COUNTER("wlan_survey_channel_ext_busy_ms", "Time the extension channel was busy in milliseconds"),
+		COUNTER("wlan_active_channel_ext_busy_ms", "Time the extension channel in use was busy in milliseconds") },
+	{ NL80211_SURVEY_INFO_CHANNEL_TIME_RX,
+		COUNTER("wlan_survey_channel_rx_time_ms", "Time spent receiving on the channel in milliseconds"),
+		COUNTER("wlan_active_channel_rx_time_ms", "Time spent receiving on the channel in use in milliseconds") },
+	{ NL80211_SURVEY_INFO_CHANNEL_TIME_TX,
+		COUNTER("wlan_survey_channel_tx_time_ms", "Time spent transmitting on the channel in milliseconds"),
+		COUNTER("wlan_active_channel_tx_time_ms", "Time spent transmitting on the channel in use in milliseconds") },
+};
+
+static const struct metric_family active_frequency_family =
+	GAUGE("wlan_active_frequency", "Frequency of the channel in use in MHz");
+
+static uint64_t survey_value(const struct survey_info *survey, uint8_t bit)
+{
+	switch (bit) {
+	case NL80211_SURVEY_INFO_NOISE:
+		return (uint64_t)(int64_t)survey->noise;
+	case NL80211_SURVEY_INFO_CHANNEL_TIME:
+		return survey->time;
+	case NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY:
+		return survey->time_busy;
+	case NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY:
+		return survey->time_ext_busy;
+	case NL80211_SURVEY_INFO_CHANNEL_TIME_RX:
+		return survey->time_rx;
+	case NL80211_SURVEY_INFO_CHANNEL_TIME_TX:
+		return survey->time_tx;
+	}
+	return 0;
+}
+
+static uint64_t tid_value(const struct tid_stats *tid, uint8_t bit)
+{
+	switch (bit) {
+	case NL80211_TID_STATS_RX_MSDU:
+		return tid->rx_msdu;
+	case NL80211_TID_STATS_TX_MSDU:
+		return tid->tx_msdu;
+	case NL80211_TID_STATS_TX_MSDU_RETRIES:
+		return tid->tx_msdu_retries;
+	case NL80211_TID_STATS_TX_MSDU_FAILED:
+		return tid->tx_msdu_failed;
+	}
+	return 0;
+}
+
+static bool is_counter(const struct metric_family *f)
+{
+	return strcmp(f->type, "counter") == 0;
+}
+
+/* HELP and TYPE go out ahead of the first sample, families without any are left out */
+static void print_family(const struct metric_family *f, bool *started, struct arena *out)
+{
+	if (*started) {
+		return;
+	}
+	arena_puts(out, "# HELP ");
+	arena_puts(out, f->name);
+	arena_puts(out, " ");
+	arena_puts(out, f->help);
+	arena_puts(out, "\n# TYPE ");
+	arena_puts(out, f->name);
+	arena_puts(out, " ");
+	arena_puts(out, f->type);
+	arena_puts(out, "\n");
+	*started = true;
+}
+
+/* " value\n", ending a sample */
+static size_t fmt_value(char *dst, const struct metric_family *f, uint64_t v)
+{
+	size_t n = 0;
+
+	dst[n++] = ' ';
+	n += f->is_signed ? fmt_i64(dst + n, (int64_t)v) : fmt_u64(dst + n, v);
+	dst[n++] = '\n';
+	return n;
+}
+
+/* OpenMetrics samples carry the collection time, " seconds.millis" */
+static size_t fmt_stamp(char *dst, const struct timespec *ts)
+{
+	uint32_t ms = (uint32_t)(ts->tv_nsec / 1000000);
+	size_t n = 0;
+
+	dst[n++] = ' ';
+	n += fmt_u64(dst + n, (uint64_t)ts->tv_sec);
+	dst[n++] = '.';
+	dst[n++] = (char)('0' + ms / 100);
+	memcpy(dst + n, &dec_pairs[(ms % 100) * 2], 2);
+	return n + 2;
+}
+
+/* End of a sample, stamp is NULL for the text format */
+static void end_sample(const char *stamp, struct arena *out)
+{
+	if (stamp) {
+		arena_puts(out, stamp);
+	}
+	arena_puts(out, "\n");
+}
+
+/* Text format samples of family f, rewritten for OpenMetrics when stamped:
+ * counter samples get the _total suffix and every sample the stamp */
+static void print_samples(const struct metric_family *f, const char *text, size_t len, const char *stamp, struct arena *out)
+{
+	const char *end = text + len;
+	size_t name_len = strlen(f->name);
+	bool counter = is_counter(f);
+
+	if (!stamp) {
+		arena_put(out, text, len);
+		return;
+	}
+	while (text < end) {
+		const char *nl = memchr(text, '\n', (size_t)(end - text));
+		if (!nl) {
+			nl = end;
+		}
+		if (counter) {
+			arena_put(out, text, name_len);
+			arena_puts(out, "_total");
+			arena_put(out, text + name_len, (size_t)(nl - text) - name_len);
+		} else {
+			arena_put(out, text, (size_t)(nl - text));
+		}
+		end_sample(stamp, out);
+		text = nl + 1;
+	}
+}
+
+static void print_value(const struct metric_family *f, uint64_t v, struct arena *out)
+{
+	char *p = arena_reserve(out, 24);
+	if (p) {
+		out->len += fmt_value(p, f, v);
+	}
+}
+
+/* name{device="...",station="..."} with room for what follows */
+static char *print_station_label(const char *name, const struct station_columns *c, size_t i, bool open, struct arena *out)
+{
+	size_t len = strlen(name);
+	size_t label_len = c->label_len[i] - (open ? 1u : 0u);
+	char *p = arena_reserve(out, len + label_len + 48);
+	if (!p) {
+		return NULL;
+	}
+	memcpy(p, name, len);
+	memcpy(p + len, c->label[i], label_len);
+	out->len += len + label_len;
+	return p + len + label_len;
+}
+
+/* name{device="..." of an interface sample, its other labels follow */
+static void print_device(const char *name, const char *dev, struct arena *out)
+{
+	arena_puts(out, name);
+	char *p = arena_reserve(out, 9 + 2 * IF_NAMESIZE + 1);
+	if (p) {
+		memcpy(p, "{device=\"", 9);
+		p += 9;
+		p += label_escape(p, dev);
+		*p++ = '"';
+		out->len = (size_t)(p - out->buf);
+	}
+}
+
+/* Families of a station blob: the columns, then the chain and TID ones */
+#define STATION_FAMILIES (STATION_COLUMNS + ARRAY_SIZE(chain_families) + ARRAY_SIZE(tid_families))
+/* Families of a survey blob: every channel one, the active frequency, every active one */
+#define SURVEY_FAMILIES (2 * ARRAY_SIZE(survey_families) + 1)
+
+static const struct metric_family *station_family(size_t k)
+{
+	if (k < STATION_COLUMNS) {
+		return &station_families[k];
+	}
+	k -= STATION_COLUMNS;
+	if (k < ARRAY_SIZE(chain_families)) {
+		return &chain_families[k];
+	}
+	return &tid_families[k - ARRAY_SIZE(chain_families)].family;
+}
+
+static const struct metric_family *survey_family(size_t k)
+{
+	if (k < ARRAY_SIZE(survey_families)) {
+		return &survey_families[k].channel;
+	}
+	if (k == ARRAY_SIZE(survey_families)) {
+		return &active_frequency_family;
+	}
+	return &survey_families[k - ARRAY_SIZE(survey_families) - 1].active;
+}
+
+/* Samples of one station, off[k] is where family k starts */
+static void render_station(const struct station_columns *c, size_t i, struct arena *out, uint32_t *off)
+{
+	size_t k = 0;
+
+	for (int col = 0; col < STATION_COLUMNS; col++) {
+		const struct metric_family *f = &station_families[col];
+		off[k++] = (uint32_t)out->len;
+		if (!(c->has[i] & BIT(col))) {
+			continue;
+		}
+		char *p = print_station_label(f->name, c, i, false, out);
+		if (p) {
+			out->len += fmt_value(p, f, c->value[col][i]);
+		}
+	}
+
+	/* The label block is left open for the chain and TID labels */
+	for (size_t n = 0; n < ARRAY_SIZE(chain_families); n++) {
+		const struct metric_family *f = &chain_families[n];
+		uint8_t chains = n ? c->chains_avg[i] : c->chains[i];
+		const int8_t *signal = n ? c->chain_signal_avg[i] : c->chain_signal[i];
+		off[k++] = (uint32_t)out->len;
+		for (int j = 0; j < chains; j++) {
+			char *p = print_station_label(f->name, c, i, true, out);
+			if (!p) {
+				continue;
+			}
+			char *start = p;
+			memcpy(p, ",chain=\"", 8);
+			p += 8;
+			p += fmt_u64(p, (uint64_t)j);
+			memcpy(p, "\"} ", 3);
+			p += 3;
+			p += fmt_i8(p, signal[j]);
+			*p++ = '\n';
+			out->len += (size_t)(p - start);
+		}
+	}
+
+	for (size_t n = 0; n < ARRAY_SIZE(tid_families); n++) {
+		const struct metric_family *f = &tid_families[n].family;
+		uint8_t bit = tid_families[n].bit;
+		off[k++] = (uint32_t)out->len;
+		for (int j = 0; j < c->tids[i]; j++) {
+			const struct tid_stats *tid = &c->tid[i][j];
+			if (!(tid->present & BIT(bit))) {
+				continue;
+			}
+			char *p = print_station_label(f->name, c, i, true, out);
+			if (!p) {
+				continue;
+			}
+			char *start = p;
+			memcpy(p, ",tid=\"", 6);
+			p += 6;
+			p += fmt_u64(p, (uint64_t)j);
+			memcpy(p, "\"}", 2);
+			p += 2;
+			out->len += (size_t)(p - start);
+			print_value(f, tid_value(tid, bit), out);
+		}
+	}
+	off[k] = (uint32_t)out->len;
+}
+
+/* Samples of one survey channel, off[k] is where family k starts */
+static void render_survey(const struct snapshot *snap, size_t i, struct arena *out, uint32_t *off)
+{
+	const struct survey_info *survey = &snap->survey[i];
+	const struct interface_info *iface = &snap->iface[survey->iface];
+	size_t k = 0;
+
+	for (size_t n = 0; n < ARRAY_SIZE(survey_families); n++) {
+		const struct metric_family *f = &survey_families[n].channel;
+		uint8_t bit = survey_families[n].bit;
+		off[k++] = (uint32_t)out->len;
+		if (!(survey->present & BIT(bit))) {
+			continue;
+		}
+		print_device(f->name, iface->name, out);
+		arena_printf(out, ",radio=\"phy%u\",frequency=\"%u\"}", iface->wiphy, survey->frequency);
+		print_value(f, survey_value(survey, bit), out);
+	}
+
+	off[k++] = (uint32_t)out->len;
+	if (survey->in_use) {
+		print_device(active_frequency_family.name, iface->name, out);
+		arena_printf(out, ",radio=\"phy%u\"} %ju\n", iface->wiphy, (uintmax_t)survey->frequency);
+	}
+	for (size_t n = 0; n < ARRAY_SIZE(survey_families); n++) {
+		const struct metric_family *f = &survey_families[n].active;
+		uint8_t bit = survey_families[n].bit;
+		off[k++] = (uint32_t)out->len;
+		if (!survey->in_use || !(survey->present & BIT(bit))) {
+			continue;
+		}
+		print_device(f->name, iface->name, out);
+		arena_printf(out, ",radio=\"phy%u\"}", iface->wiphy);
+		print_value(f, survey_value(survey, bit), out);
+	}
+	off[k] = (uint32_t)out->len;
+}
+
+/* Fingerprints cover everything a blob is rendered from */
+static uint64_t fp_mix(uint64_t h, uint64_t v)
+{
+	h = (h ^ v) * 0x100000001b3ULL;
+	return h ^ (h >> 29);
+}
+
+static uint64_t fp_bytes(uint64_t h, const void *data, size_t len)
+{
+	const char *p = data;
+	uint64_t v;
+
+	for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		h = fp_mix(h, v);
+	}
+	v = 0;
+	memcpy(&v, p, len);
+	return fp_mix(h, v ^ len);
+}
+
+static uint64_t station_fingerprint(const struct station_columns *c, size_t i)
+{
+	uint64_t h = fp_bytes(0xcbf29ce484222325ULL, c->label[i], c->label_len[i]);
+
+	h = fp_mix(h, c->has[i]);
+	for (int col = 0; col < STATION_COLUMNS; col++) {
+		if (c->has[i] & BIT(col)) {
+			h = fp_mix(h, c->value[col][i]);
+		}
+	}
+	h = fp_mix(h, c->chains[i]);
+	h = fp_bytes(h, c->chain_signal[i], c->chains[i]);
+	h = fp_mix(h, c->chains_avg[i]);
+	h = fp_bytes(h, c->chain_signal_avg[i], c->chains_avg[i]);
+	h = fp_mix(h, c->tids[i]);
+	for (int j = 0; j < c->tids[i]; j++) {
+		const struct tid_stats *tid = &c->tid[i][j];
+		h = fp_mix(h, tid->present);
+		h = fp_mix(h, tid->rx_msdu);
+		h = fp_mix(h, tid->tx_msdu);
+		h = fp_mix(h, tid->tx_msdu_retries);
+		h = fp_mix(h, tid->tx_msdu_failed);
+	}
+	return h;
+}
+
+static uint64_t survey_fingerprint(const struct snapshot *snap, size_t i)
+{
+	const struct survey_info *s = &snap->survey[i];
+	const struct interface_info *iface = &snap->iface[s->iface];
+	uint64_t h = fp_bytes(0xcbf29ce484222325ULL, iface->name, strlen(iface->name));
+
+	h = fp_mix(h, iface->wiphy);
+	h = fp_mix(h, s->frequency | (uint64_t)s->in_use << 32);
+	h = fp_mix(h, s->present);
+	h = fp_mix(h, (uint64_t)(int64_t)s->noise);
+	h = fp_mix(h, s->time);
+	h = fp_mix(h, s->time_busy);
+	h = fp_mix(h, s->time_ext_busy);
+	h = fp_mix(h, s->time_rx);
+	return fp_mix(h, s->time_tx);
+}
+
+static struct render_blob *blob_new(const struct arena *text, const uint32_t *off, uint32_t families)
+{
+	size_t offsets = (families + 1) * sizeof(*off);
+	struct render_blob *b = malloc(sizeof(*b) + offsets + text->len);
+	if (!b) {
+		return NULL;
+	}
+	atomic_init(&b->refs, 1);
+	b->families = families;
+	memcpy(b->off, off, offsets);
+	memcpy((char *)b->off + offsets, text->buf, text->len);
+	return b;
+}
+
+static const char *blob_text(const struct render_blob *b)
+{
+	return (const char *)&b->off[b->families + 1];
+}
+
+static struct render_blob *blob_get(struct render_blob *b)
+{
+	atomic_fetch_add(&b->refs, 1);
+	return b;
+}
+
+static void blob_put(struct render_blob *b)
+{
+	if (b && atomic_fetch_sub(&b->refs, 1) == 1) {
+		free(b);
+	}
+}
+
+/* Last rendered blob of every station and survey channel, keyed on
+ * interface and MAC address or frequency. Entries not used by a
+ * collection are dropped at its end. */
+struct render_entry {
+	uint32_t ifindex;	/* 0 marks a free slot */
+	uint8_t key[ETH_ALEN];
+	uint32_t generation;	/* of the collection that last used it */
+	uint64_t fingerprint;
+	struct render_blob *blob;
+};
+
+struct render_cache {
+	size_t count;
+	size_t used;		/* by the current generation */
+	size_t mask;		/* number of slots - 1, always a power of two */
+	struct render_entry *slot;
+};
+
+static struct render_cache station_renders;
+static struct render_cache survey_renders;
+static uint32_t render_generation;
+static struct arena render_scratch;
+
+static struct render_entry *render_cache_slot(const struct render_cache *rc, uint32_t ifindex, const uint8_t *key)
+{
+	size_t i = station_hash(ifindex, key) & rc->mask;
+	while (rc->slot[i].ifindex) {
+		if (rc->slot[i].ifindex == ifindex && memcmp(rc->slot[i].key, key, ETH_ALEN) == 0) {
+			break;
+		}
+		i = (i + 1) & rc->mask;
+	}
+	return &rc->slot[i];
+}
+
+/* Rehash into slots entries, dropping the ones the last collection did not use */
+static int render_cache_resize(struct render_cache *rc, size_t slots, bool sweep)
+{
+	struct render_entry *old = rc->slot;
+	size_t old_slots = old ? rc->mask + 1 : 0;
+
+	rc->slot = calloc(slots, sizeof(*rc->slot));
+	if (!rc->slot) {
+		rc->slot = old;
+		return -ENOMEM;
+	}
+	rc->mask = slots - 1;
+	rc->count = 0;
+	for (size_t i = 0; i < old_slots; i++) {
+		if (!old[i].ifindex) {
+			continue;
+		}
+		if (sweep && old[i].generation != render_generation) {
+			blob_put(old[i].blob);
+			continue;
+		}
+		*render_cache_slot(rc, old[i].ifindex, old[i].key) = old[i];
+		rc->count++;
+	}
+	free(old);
+	return 0;
+}
+
+/* Blob for the given fingerprint, re-rendered only if it changed */
+static struct render_blob *render_cache_get(struct render_cache *rc, uint32_t ifindex, const uint8_t *key,
+		uint64_t fingerprint, uint32_t families, void (*render)(const void *, size_t, struct arena *, uint32_t *),
+		const void *src, size_t row)
+{
+	/* Keep the load factor at or below one half */
+	if (!rc->slot || (rc->count + 1) * 2 > rc->mask + 1) {
+		if (render_cache_resize(rc, rc->slot ? (rc->mask + 1) * 2 : 64, false)) {
+			return NULL;
+		}
+	}
+	struct render_entry *e = render_cache_slot(rc, ifindex, key);
+	if (!e->ifindex) {
+		e->ifindex = ifindex;
+		memcpy(e->key, key, ETH_ALEN);
+		e->blob = NULL;
+		rc->count++;
+	}
+	if (e->generation != render_generation) {
+		e->generation = render_generation;
+		rc->used++;
+	}
+	if (!e->blob || e->fingerprint != fingerprint) {
+		uint32_t off[STATION_FAMILIES > SURVEY_FAMILIES ? STATION_FAMILIES + 1 : SURVEY_FAMILIES + 1];
+		render_scratch.len = 0;
+		render_scratch.failed = false;
+		render(src, row, &render_scratch, off);
+		struct render_blob *b = render_scratch.failed ? NULL : blob_new(&render_scratch, off, families);
+		if (!b) {
+			return NULL;
+		}
+		blob_put(e->blob);
+		e->blob = b;
+		e->fingerprint = fingerprint;
+	}
+	return blob_get(e->blob);
+}
+
+static void render_cache_sweep(struct render_cache *rc)
+{
+	if (rc->used < rc->count) {
+		render_cache_resize(rc, rc->mask + 1, true);
+	}
+	rc->used = 0;
+}
+
+static void render_station_row(const void *c, size_t i, struct arena *out, uint32_t *off)
+{
+	render_station(c, i, out, off);
+}
+
+static void render_survey_row(const void *snap, size_t i, struct arena *out, uint32_t *off)
+{
+	render_survey(snap, i, out, off);
+}
+
+/* Give every row of a fresh snapshot its blob, only stations and channels
+ * whose values changed since the last collection are rendered again */
+static int render_rows(struct snapshot *snap)
+{
+	struct station_columns *c = &snap->sta;
+	int rv = 0;
+
+	render_generation++;
+	for (size_t i = 0; i < c->count; i++) {
+		uint32_t ifindex = snap->iface[c->iface[i]].ifindex;
+		c->blob[i] = render_cache_get(&station_renders, ifindex, c->mac[i], station_fingerprint(c, i),
+				STATION_FAMILIES, render_station_row, c, i);
+		if (!c->blob[i]) {
+			rv = -ENOMEM;
+		}
+	}
+	for (size_t i = 0; i < snap->survey_count; i++) {
+		struct survey_info *s = &snap->survey[i];
+		uint8_t key[ETH_ALEN] = {0};
+		memcpy(key, &s->frequency, sizeof(s->frequency));
+		s->blob = render_cache_get(&survey_renders, s->ifindex, key, survey_fingerprint(snap, i),
+				SURVEY_FAMILIES, render_survey_row, snap, i);
+		if (!s->blob) {
+			rv = -ENOMEM;
+		}
+	}
+	render_cache_sweep(&station_renders);
+	render_cache_sweep(&survey_renders);
+	return rv;
+}
+
+/* Drop the blob references of a snapshot before it is refilled */
+static void release_rows(struct snapshot *snap)
+{
+	for (size_t i = 0; i < snap->sta.count; i++) {
+		blob_put(snap->sta.blob[i]);
+	}
+	for (size_t i = 0; i < snap->survey_count; i++) {
+		blob_put(snap->survey[i].blob);
+	}
+}
+
+/* Family k of a blob, HELP and TYPE ahead of the first non-empty one */
+static void print_segment(const struct metric_family *f, bool *started, const struct render_blob *b, size_t k,
+		const char *stamp, struct arena *out)
+{
+	if (!b || b->off[k + 1] == b->off[k]) {
+		return;
+	}
+	print_family(f, started, out);
+	print_samples(f, blob_text(b) + b->off[k], b->off[k + 1] - b->off[k], stamp, out);
+}
+
+static void render_tx_power(const struct snapshot *snap, const char *stamp, struct arena *out)
+{
+	bool started = false;
+	for (int i = 0; i < snap->if_count; i++) {
+		const struct interface_info *iface = &snap->iface[i];
+		if (!(iface->present & BIT(IFACE_TX_POWER))) {
+			continue;
+		}
+		print_family(&tx_power_family, &started, out);
+		print_device(tx_power_family.name, iface->name, out);
+		arena_puts(out, "} ");
+		char *p = arena_reserve(out, 24);
+		if (p) {
+			out->len += fmt_mbm(p, (int32_t)iface->tx_power);
+		}
+		end_sample(stamp, out);
+	}
+}
+
+/* A body is rendered in parts of whole families: the transmit power, every
+ * station family, every survey family and the station counts. Streamed
+ * responses render a few parts at a time. */
+#define METRIC_PARTS (STATION_FAMILIES + SURVEY_FAMILIES + 2)
+
+/* Text or OpenMetrics, the latter is stamped with the collection time and
+ * left for the caller to end with # EOF */
+static void render_metrics_part(const struct snapshot *snap, enum body_format format, size_t part, struct arena *out)
+{
+	char buf[32];
+	const char *stamp = NULL;
+	if (format == FORMAT_OPENMETRICS) {
+		buf[fmt_stamp(buf, &snap->collected)] = '\0';
+		stamp = buf;
+	}
+
+	bool started = false;
+	if (part == 0) {
+		render_tx_power(snap, stamp, out);
+		return;
+	}
+	/* Stations and channels are spliced family by family from their blobs */
+	if (--part < STATION_FAMILIES) {
+		for (size_t i = 0; i < snap->sta.count; i++) {
+			print_segment(station_family(part), &started, snap->sta.blob[i], part, stamp, out);
+		}
+		return;
+	}
+	if ((part -= STATION_FAMILIES) < SURVEY_FAMILIES) {
+		for (size_t i = 0; i < snap->survey_count; i++) {
+			print_segment(survey_family(part), &started, snap->survey[i].blob, part, stamp, out);
+		}
+		return;
+	}
+	for (int i = 0; i < snap->if_count; i++) {
+		print_family(&num_stations_family, &started, out);
+		print_device(num_stations_family.name, snap->iface[i].name, out);
+		arena_printf(out, "} %ju", (uintmax_t)snap->iface[i].num_sta);
+		end_sample(stamp, out);
+	}
+}
+
+/* Prometheus protobuf exposition: MetricFamily messages, each preceded by
+ * its length as a varint. Everything is encoded straight into the arena,
+ * the length of a family is filled in once it is complete. */
+#define PB_VARINT 0
+#define PB_I64 1
+#define PB_LEN 2
+#define PB_KEY(field, wire) ((char)((field) << 3 | (wire)))
+#define PB_LEN_MAX 5		/* varint of a 32 bit length */
+
+static size_t pb_varint_len(uint64_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static size_t pb_varint(char *dst, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		dst[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	dst[n++] = (char)v;
+	return n;
+}
+
+static size_t pb_string(char *dst, int field, const char *str, size_t len)
+{
+	size_t n = 0;
+	dst[n++] = PB_KEY(field, PB_LEN);
+	n += pb_varint(dst + n, len);
+	memcpy(dst + n, str, len);
+	return n + len;
+}
+
+struct pb_label {
+	const char *name;
+	const char *value;
+	size_t len;
+};
+
+#define PB_LABELS_MAX 4
+
+/* One Metric of a family: its label pairs and a gauge or counter value */
+static void pb_metric(struct arena *out, bool counter, const struct pb_label *label, size_t labels, double value)
+{
+	size_t pair[PB_LABELS_MAX];
+	size_t name_len[PB_LABELS_MAX];
+	size_t size = 11;	/* Gauge or Counter holding a double */
+
+	for (size_t i = 0; i < labels; i++) {
+		name_len[i] = strlen(label[i].name);
+		pair[i] = 2 + pb_varint_len(name_len[i]) + name_len[i] + pb_varint_len(label[i].len) + label[i].len;
+		size += 1 + pb_varint_len(pair[i]) + pair[i];
+	}
+	char *p = arena_reserve(out, 1 + PB_LEN_MAX + size);
+	if (!p) {
+		return;
+	}
+	char *start = p;
+	*p++ = PB_KEY(4, PB_LEN);	/* MetricFamily.metric */
+	p += pb_varint(p, size);
+	for (size_t i = 0; i < labels; i++) {
+		*p++ = PB_KEY(1, PB_LEN);	/* Metric.label */
+		p += pb_varint(p, pair[i]);
+		p += pb_string(p, 1, label[i].name, name_len[i]);
+		p += pb_string(p, 2, label[i].value, label[i].len);
+	}
+	*p++ = PB_KEY(counter ? 3 : 2, PB_LEN);	/* Metric.counter or Metric.gauge */
+	*p++ = 9;
+	*p++ = PB_KEY(1, PB_I64);
+	/* Doubles are little endian on the wire, whatever the host is */
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	for (int i = 0; i < 8; i++) {
+		*p++ = (char)(bits >> (8 * i));
+	}
+	out->len += (size_t)(p - start);
+}
+
+/* Name, help and type of a family, room is left for its length */
+static size_t pb_family_begin(struct arena *out, const struct metric_family *f)
+{
+	size_t start = out->len;
+	size_t name_len = strlen(f->name);
+	size_t help_len = strlen(f->help);
+	char *p = arena_reserve(out, 3 * PB_LEN_MAX + name_len + help_len + 4);
+	if (!p) {
+		return start;
+	}
+	char *pos = p + PB_LEN_MAX;
+	pos += pb_string(pos, 1, f->name, name_len);
+	pos += pb_string(pos, 2, f->help, help_len);
+	*pos++ = PB_KEY(3, PB_VARINT);
+	*pos++ = is_counter(f) ? 0 : 1;	/* COUNTER or GAUGE */
+	out->len += (size_t)(pos - p);
+	return start;
+}
+
+/* Fill in the length of the family, one without metrics is dropped */
+static void pb_family_end(struct arena *out, size_t start, size_t metrics)
+{
+	if (!metrics || out->failed) {
+		out->len = start;
+		return;
+	}
+	char prefix[PB_LEN_MAX];
+	size_t len = out->len - start - PB_LEN_MAX;
+	size_t n = pb_varint(prefix, len);
+	memmove(out->buf + start + n, out->buf + start + PB_LEN_MAX, len);
+	memcpy(out->buf + start, prefix, n);
+	out->len = start + n + len;
+}
+
+static void pb_station_family(const struct snapshot *snap, size_t k, struct arena *out)
+{
+	const struct station_columns *c = &snap->sta;
+	const struct metric_family *f = station_family(k);
+	bool counter = is_counter(f);
+	size_t start = pb_family_begin(out, f);
+	size_t metrics = 0;
+	char mac[MAC_TEXT_LEN];
+	char index[4];
+	struct pb_label label[3] = {
+		{ "device", NULL, 0 },
+		{ "station", mac, MAC_TEXT_LEN },
+		{ k < STATION_COLUMNS + ARRAY_SIZE(chain_families) ? "chain" : "tid", index, 0 },
+	};
+
+	for (size_t i = 0; i < c->count; i++) {
+		const char *dev = snap->iface[c->iface[i]].name;
+		label[0].value = dev;
+		label[0].len = strlen(dev);
+		fmt_mac(mac, c->mac[i]);
+
+		if (k < STATION_COLUMNS) {
+			if (!(c->has[i] & BIT(k))) {
+				continue;
+			}
+			uint64_t v = c->value[k][i];
+			pb_metric(out, counter, label, 2, f->is_signed ? (double)(int64_t)v : (double)v);
+			metrics++;
+		} else if (k < STATION_COLUMNS + ARRAY_SIZE(chain_families)) {
+			bool avg = k > STATION_COLUMNS;
+			uint8_t chains = avg ? c->chains_avg[i] : c->chains[i];
+			const int8_t *signal = avg ? c->chain_signal_avg[i] : c->chain_signal[i];
+			for (int j = 0; j < chains; j++) {
+				label[2].len = fmt_u64(index, (uint64_t)j);
+				pb_metric(out, counter, label, 3, signal[j]);
+				metrics++;
+			}
+		} else {
+			uint8_t bit = tid_families[k - STATION_COLUMNS - ARRAY_SIZE(chain_families)].bit;
+			for (int j = 0; j < c->tids[i]; j++) {
+				const struct tid_stats *tid = &c->tid[i][j];
+				if (!(tid->present & BIT(bit))) {
+					continue;
+				}
+				label[2].len = fmt_u64(index, (uint64_t)j);
+				pb_metric(out, counter, label, 3, (double)tid_value(tid, bit));
+				metrics++;
+			}
+		}
+	}
+	pb_family_end(out, start, metrics);
+}
+
+static void pb_survey_family(const struct snapshot *snap, size_t k, struct arena *out)
+{
+	const struct metric_family *f = survey_family(k);
+	bool counter = is_counter(f);
+	bool active = k >= ARRAY_SIZE(survey_families);
+	size_t start = pb_family_begin(out, f);
+	size_t metrics = 0;
+	char radio[16];
+	char frequency[12];
+	struct pb_label label[3] = {
+		{ "device", NULL, 0 },
+		{ "radio", radio, 0 },
+		{ "frequency", frequency, 0 },
+	};
+
+	for (size_t i = 0; i < snap->survey_count; i++) {
+		const struct survey_info *survey = &snap->survey[i];
+		const struct interface_info *iface = &snap->iface[survey->iface];
+		double value;
+
+		if (k == ARRAY_SIZE(survey_families)) {
+			if (!survey->in_use) {
+				continue;
+			}
+			value = survey->frequency;
+		} else {
+			uint8_t bit = survey_families[active ? k - ARRAY_SIZE(survey_families) - 1 : k].bit;
+			if ((active && !survey->in_use) || !(survey->present & BIT(bit))) {
+				continue;
+			}
+			uint64_t v = survey_value(survey, bit);
+			value = f->is_signed ? (double)(int64_t)v : (double)v;
+		}
+		label[0].value = iface->name;
+		label[0].len = strlen(iface->name);
+		memcpy(radio, "phy", 3);
+		label[1].len = 3 + fmt_u64(radio + 3, iface->wiphy);
+		label[2].len = fmt_u64(frequency, survey->frequency);
+		pb_metric(out, counter, label, active ? 2 : 3, value);
+		metrics++;
+	}
+	pb_family_end(out, start, metrics);
+}
+
+/* The same families as render_metrics_part(), in the same parts */
+static void encode_metrics_part(const struct snapshot *snap, size_t part, struct arena *out)
+{
+	struct pb_label device = { "device", NULL, 0 };
+	size_t start, metrics = 0;
+
+	if (part == 0) {
+		start = pb_family_begin(out, &tx_power_family);
+		for (int i = 0; i < snap->if_count; i++) {
+			const struct interface_info *iface = &snap->iface[i];
+			if (!(iface->present & BIT(IFACE_TX_POWER))) {
+				continue;
+			}
+			device.value = iface->name;
+			device.len = strlen(iface->name);
+			pb_metric(out, false, &device, 1, (int32_t)iface->tx_power / 100.0);
+			metrics++;
+		}
+		pb_family_end(out, start, metrics);
+		return;
+	}
+	if (--part < STATION_FAMILIES) {
+		pb_station_family(snap, part, out);
+		return;
+	}
+	if ((part -= STATION_FAMILIES) < SURVEY_FAMILIES) {
+		pb_survey_family(snap, part, out);
+		return;
+	}
+
+	start = pb_family_begin(out, &num_stations_family);
+	for (int i = 0; i < snap->if_count; i++) {
+		device.value = snap->iface[i].name;
+		device.len = strlen(snap->iface[i].name);
+		pb_metric(out, false, &device, 1, snap->iface[i].num_sta);
+	}
+	pb_family_end(out, start, (size_t)snap->if_count);
+}
+
+static int worker_send(struct nl_worker *w, struct nl_request *req)
+{
+	union nl_txbuf tx;
+
+	req->seq = nl_next_seq();
+	struct nlmsghdr *nlh = genl_put(&tx, (uint16_t)session.nl80211_id, req->flags, req->seq, req->cmd);
+	if (req->ifindex) {
+		attr_put(nlh, NL80211_ATTR_IFINDEX, &req->ifindex, sizeof(req->ifindex));
+	}
+	if (req->station) {
+		attr_put(nlh, NL80211_ATTR_MAC, req->station->mac, ETH_ALEN);
+	}
+
+	int rv = nl_send(w->fd, nlh);
+	if (rv) {
+		fprintf(stderr, "Failed to send netlink message: %s\n", strerror(-rv));
+		return -EIO;
+	}
+	req->err = 1;
+	w->req[w->inflight++] = req;
+	if (req->flags & NLM_F_DUMP) {
+		w->dumping = true;
+	}
+	return 0;
+}
+
+/* Run all requests to completion. Kernel errors are left in the requests,
+ * the return value only reports failures of the sockets themselves. */
+static int nl_run(struct client_context *ctx, struct nl_request *req, size_t count)
+{
+	size_t next = 0;
+	int rv = 0;
+
+	engine_ctx = ctx;
+	engine_pending = count;
+	while (rv == 0 && engine_pending) {
+		struct pollfd pfd[NL_WORKERS];
+		for (int i = 0; i < NL_WORKERS; i++) {
+			struct nl_worker *w = &session.worker[i];
+			while (rv == 0 && next < count && !w->dumping && w->inflight < NL_WINDOW &&
+			       (!(req[next].flags & NLM_F_DUMP) || w->inflight == 0)) {
+				rv = worker_send(w, &req[next++]);
+			}
+			pfd[i].fd = w->inflight ? w->fd : -1;
+			pfd[i].events = POLLIN;
+		}
+		if (rv) {
+			break;
+		}
+
+		int n = poll(pfd, NL_WORKERS, 5000);
+		if (n == 0) {
+			fprintf(stderr, "Timed out waiting for nl80211.\n");
+			rv = -ETIMEDOUT;
+		} else if (n < 0 && errno != EINTR) {
+			rv = -errno;
+		}
+		for (int i = 0; rv == 0 && n > 0 && i < NL_WORKERS; i++) {
+			if (pfd[i].revents) {
+				int err = worker_receive(&session.worker[i]);
+				if (err < 0) {
+					fprintf(stderr, "Failed to receive netlink message: %s\n", strerror(-err));
+					rv = -EIO;
+				}
+			}
+		}
+	}
+	if (rv) {
+		/* Replies may still be queued, start over on a fresh session.
+		 * Until then no worker may wait for requests of this run. */
+		session.broken = true;
+		for (int i = 0; i < NL_WORKERS; i++) {
+			struct nl_worker *w = &session.worker[i];
+			w->inflight = 0;
+			w->dumping = false;
+			memset(w->req, 0, sizeof(w->req));
+		}
+	}
+	engine_ctx = NULL;
+	return rv;
+}
+
+/* Queue of requests for the next nl_run(), reused between collections */
+static struct nl_request *queue;
+static size_t queue_count;
+static size_t queue_alloc;
+
+static int queue_request(uint8_t cmd, int flags, uint32_t ifindex, struct station_entry *station,
+		void (*handler)(const struct nlmsghdr *, void *))
+{
+	void *p = array_grow(queue, &queue_alloc, queue_count, sizeof(*queue));
+	if (!p) {
+		return -ENOMEM;
+	}
+	queue = p;
+	struct nl_request *req = &queue[queue_count++];
+	memset(req, 0, sizeof(*req));
+	req->cmd = cmd;
+	req->flags = flags;
+	req->ifindex = ifindex;
+	req->station = station;
+	req->handler = handler;
+	return 0;
+}
+
+/* Collect a complete snapshot over the shared nl80211 session */
+static int collect_metrics(struct snapshot *snap)
+{
+	struct client_context ctx = {0};
+	ctx.snap = snap;
+	release_rows(snap);
+	snap->generation = 0;
+	snap->if_count = 0;
+	if (snap->if_index) {
+		memset(snap->if_index, 0, (snap->if_mask + 1) * sizeof(*snap->if_index));
+	}
+	snap->sta.count = 0;
+	snap->survey_count = 0;
+
+	/* Only the collector thread of this process uses the session */
+	if (session.broken || session.nl80211_id < 0) {
+		int rv = nl80211_connect(&session);
+		if (rv) {
+			return rv;
+		}
+		session.broken = false;
+	}
+
+	queue_count = 0;
+	int rv = queue_request(NL80211_CMD_GET_INTERFACE, NLM_F_DUMP, 0, NULL, list_interface_handler);
+	if (rv == 0) {
+		rv = nl_run(&ctx, queue, queue_count);
+	}
+	if (rv == 0) {
+		rv = queue[0].err;
+	}
+
+	/* Stations are either refreshed one by one from the table, or the
+	 * table is seeded from full dumps. Surveys are always dumped, once
+	 * per radio. */
+	bool seeding = !stations.valid;
+	queue_count = 0;
+	if (seeding) {
+		station_table_clear(&stations);
+		for (int i = 0; rv == 0 && i < snap->if_count; i++) {
+			/* Monitor interfaces never have stations */
+			if (snap->iface[i].iftype == NL80211_IFTYPE_MONITOR) {
+				continue;
+			}
+			rv = queue_request(NL80211_CMD_GET_STATION, NLM_F_DUMP, snap->iface[i].ifindex, NULL, station_dump_handler);
+		}
+	} else {
+		for (size_t i = 0; rv == 0 && stations.slot && i <= stations.mask; i++) {
+			struct station_entry *e = &stations.slot[i];
+			if (e->ifindex) {
+				rv = queue_request(NL80211_CMD_GET_STATION, 0, e->ifindex, e, station_dump_handler);
+			}
+		}
+	}
+	for (int i = 0; rv == 0 && i < snap->if_count; i++) {
+		if (!first_on_radio(snap, i)) {
+			continue;
+		}
+		rv = queue_request(NL80211_CMD_GET_SURVEY, NLM_F_DUMP, snap->iface[i].ifindex, NULL, survey_dump_handler);
+	}
+	if (rv == 0) {
+		rv = nl_run(&ctx, queue, queue_count);
+	}
+
+	/* A failed request only loses its own part of the snapshot */
+	bool swept = false;
+	for (size_t i = 0; rv == 0 && i < queue_count; i++) {
+		struct nl_request *req = &queue[i];
+		if (req->station && (req->err == -ENOENT || req->err == -ENODEV)) {
+			/* Gone without us seeing the event */
+			req->station->stale = true;
+			swept = true;
+		} else if (req->err) {
+			fprintf(stderr, "nl80211 command %u on interface %u failed: %s\n",
+					req->cmd, req->ifindex, strerror(-req->err));
+			if (req->cmd == NL80211_CMD_GET_STATION) {
+				seeding = false;
+				stations.valid = false;
+			}
+		}
+	}
+	if (swept && station_table_resize(&stations, stations.mask + 1)) {
+		stations.valid = false;
+	}
+	clock_gettime(CLOCK_REALTIME, &snap->collected);
+	if (rv == 0 && seeding) {
+		for (size_t i = 0; rv == 0 && i < snap->sta.count; i++) {
+			rv = station_table_add(&stations, snap->iface[snap->sta.iface[i]].ifindex, snap->sta.mac[i]);
+		}
+		stations.valid = rv == 0 && session.events >= 0;
+	}
+	uint64_t generation = generation_next();
+	if (rv == 0) {
+		rv = render_rows(snap);
+	}
+	if (rv == 0) {
+		snap->generation = generation;
+	}
+	if (rv) {
+		fprintf(stderr, "Collection failed: %s\n", strerror(-rv));
+	}
+	return rv;
+}
+
+static void cache_lock(struct scrape_cache *c)
+{
+	if (pthread_mutex_lock(&c->lock) == EOWNERDEAD) {
+		/* The previous owner died, possibly halfway through a copy */
+		c->len = 0;
+		pthread_mutex_consistent(&c->lock);
+	}
+}
+
+/* Age and generation of the cached body if it is young enough to reuse,
+ * or at least of the wanted generation when that is not 0. The body
+ * itself is left in the cache. */
+static bool cache_lookup(struct scrape_cache *c, uint64_t wanted, int64_t *age_ms, uint64_t *generation)
+{
+	bool hit = false;
+
+	if (!c) {
+		return false;
+	}
+	cache_lock(c);
+	if (c->len) {
+		*age_ms = elapsed_ms(&c->rendered);
+		if (*age_ms < cache_window_ms || (wanted && c->generation >= wanted)) {
+			hit = true;
+			*generation = c->generation;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return hit;
+}
+
+/* Copy the cached body into out, false if the cache no longer holds the
+ * one of generation */
+static bool cache_copy(struct scrape_cache *c, uint64_t generation, struct arena *out)
+{
+	bool copied = false;
+
+	if (!c) {
+		return false;
+	}
+	cache_lock(c);
+	if (c->len && c->generation == generation) {
+		out->len = 0;
+		arena_put(out, c->body, c->len);
+		copied = out->len == c->len;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return copied;
+}
+
+/* Whether cache_lookup() would find a body */
+static bool cache_fresh(struct scrape_cache *c)
+{
+	bool fresh = false;
+
+	if (!c) {
+		return false;
+	}
+	cache_lock(c);
+	fresh = c->len && elapsed_ms(&c->rendered) < cache_window_ms;
+	pthread_mutex_unlock(&c->lock);
+	return fresh;
+}
+
+static void cache_put(struct scrape_cache *c, const char *body, size_t len, uint64_t generation)
+{
+	if (!c || len > SCRAPE_CACHE_SIZE) {
+		return;
+	}
+	cache_lock(c);
+	if (c->len && c->generation > generation) {
+		/* Workers may render from an older snapshot than the cached one */
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	memcpy(c->body, body, len);
+	c->len = len;
+	c->generation = generation;
+	clock_gettime(CLOCK_MONOTONIC, &c->rendered);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Whether an Accept-Encoding value allows gzip, gzip;q=0 does not */
+static bool accepts_gzip(const char *value)
+{
+	const char *p = value;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		size_t len = strcspn(p, " \t,;\r\n");
+		const char *end = p + strcspn(p, ",");
+		if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+		    (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+			const char *q = memchr(p, ';', (size_t)(end - p));
+			if (!q) {
+				return true;
+			}
+			q += 1 + strspn(q + 1, " \t");
+			return !((*q == 'q' || *q == 'Q') && q[1] == '=' && strtod(q + 2, NULL) <= 0);
+		}
+		p = end;
+	}
+	return false;
+}
+
+/* One gzip member holding len bytes of data, appended to out */
+static int gzip_append(const char *data, size_t len, struct arena *out)
+{
+	z_stream zs;
+	int rv;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 bits of window, 16 more for a gzip header and trailer */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -ENOMEM;
+	}
+	zs.next_in = (const Bytef *)data;
+	zs.avail_in = (uInt)len;
+	size_t room = deflateBound(&zs, (uLong)len);
+	do {
+		char *p = arena_reserve(out, room);
+		if (!p) {
+			deflateEnd(&zs);
+			return -ENOMEM;
+		}
+		zs.next_out = (Bytef *)p;
+		zs.avail_out = (uInt)room;
+		rv = deflate(&zs, Z_FINISH);
+		out->len += room - zs.avail_out;
+	} while (rv == Z_OK);
+	deflateEnd(&zs);
+	return rv == Z_STREAM_END ? 0 : -EIO;
+}
+
+/* Compressed body of a snapshot into out. The cache lock is held while
+ * compressing, so handlers scraping the same snapshot wait and copy. */
+static int gzip_body(struct scrape_cache *c, const struct arena *in, uint64_t generation, struct arena *out)
+{
+	int rv = 0;
+
+	out->len = 0;
+	out->failed = false;
+	if (!c) {
+		return gzip_append(in->buf, in->len, out);
+	}
+	cache_lock(c);
+	if (generation && c->len && c->generation == generation) {
+		arena_put(out, c->body, c->len);
+		rv = out->failed ? -ENOMEM : 0;
+		pthread_mutex_unlock(&c->lock);
+		return rv;
+	}
+	rv = gzip_append(in->buf, in->len, out);
+	if (rv == 0 && generation && out->len <= SCRAPE_CACHE_SIZE) {
+		memcpy(c->body, out->buf, out->len);
+		c->len = out->len;
+		c->generation = generation;
+		clock_gettime(CLOCK_MONOTONIC, &c->rendered);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return rv;
+}
+
+static const char *const format_type[BODY_FORMATS] = {
+	[FORMAT_TEXT] = "text/plain; version=0.0.4",
+	[FORMAT_PROTOBUF] = "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited",
+	[FORMAT_OPENMETRICS] = "application/openmetrics-text; version=1.0.0; charset=utf-8",
+};
+
+/* Value of parameter name in the parameters of a media range, or NULL */
+static const char *accept_param(const char *p, const char *end, const char *name, size_t *len)
+{
+	size_t name_len = strlen(name);
+
+	while ((p = memchr(p, ';', (size_t)(end - p)))) {
+		p++;
+		p += strspn(p, " \t");
+		if ((size_t)(end - p) > name_len && strncasecmp(p, name, name_len) == 0 && p[name_len] == '=') {
+			p += name_len + 1;
+			*len = strcspn(p, " \t;,\r\n");
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static bool accept_param_is(const char *p, const char *end, const char *name, const char *value)
+{
+	size_t len;
+	const char *v = accept_param(p, end, name, &len);
+	return v && len == strlen(value) && strncmp(v, value, len) == 0;
+}
+
+/* Format the Accept header value prefers, text unless it asks otherwise */
+static enum body_format negotiate_format(const char *accept)
+{
+	static const char protobuf[] = "application/vnd.google.protobuf";
+	static const char openmetrics[] = "application/openmetrics-text";
+	enum body_format best = FORMAT_TEXT;
+	double best_q = 0;
+	const char *p = accept;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		const char *end = p + strcspn(p, ",\r\n");
+		size_t len = strcspn(p, " \t;,\r\n");
+		size_t q_len;
+		const char *q = accept_param(p, end, "q", &q_len);
+		double weight = q ? strtod(q, NULL) : 1;
+		int format = -1;
+
+		if (len == sizeof(protobuf) - 1 && strncasecmp(p, protobuf, len) == 0 &&
+		    accept_param_is(p, end, "proto", "io.prometheus.client.MetricFamily") &&
+		    accept_param_is(p, end, "encoding", "delimited")) {
+			format = FORMAT_PROTOBUF;
+		} else if (len == sizeof(openmetrics) - 1 && strncasecmp(p, openmetrics, len) == 0) {
+			format = FORMAT_OPENMETRICS;
+		} else if ((len == 10 && strncasecmp(p, "text/plain", len) == 0) ||
+			   (len == 6 && strncasecmp(p, "text/*", len) == 0) ||
+			   (len == 3 && strncmp(p, "*/*", len) == 0)) {
+			format = FORMAT_TEXT;
+		}
+		if (format >= 0 && weight > best_q) {
+			best = (enum body_format)format;
+			best_q = weight;
+		}
+		p = *end ? end + 1 : end;
+		if (!*end || *end == '\r' || *end == '\n') {
+			break;
+		}
+	}
+	return best;
+}
+
+static const struct metric_family cache_age_family =
+	GAUGE("wlan_exporter_cache_age_ms", "Age of the cached response in milliseconds");
+
+/* What follows a cached body in every response built from it: its age
+ * when caching is on, and the end marker of OpenMetrics */
+static void render_tail(enum body_format format, int64_t age_ms, struct arena *out)
+{
+	bool started = false;
+
+	if (cache_window_ms) {
+		switch (format) {
+		case FORMAT_PROTOBUF: {
+			size_t start = pb_family_begin(out, &cache_age_family);
+			pb_metric(out, false, NULL, 0, (double)age_ms);
+			pb_family_end(out, start, 1);
+			break;
+		}
+		case FORMAT_OPENMETRICS:
+			print_family(&cache_age_family, &started, out);
+			/* fall through */
+		default:
+			arena_printf(out, "wlan_exporter_cache_age_ms %jd\n", (intmax_t)age_ms);
+			break;
+		}
+	}
+	if (format == FORMAT_OPENMETRICS) {
+		arena_puts(out, "# EOF\n");
+	}
+}
+
+/* The arena starts out as large as the last scrape needed, so in steady
+ * state rendering never has to grow it */
+static struct arena body;
+
+static void render_part(const struct snapshot *snap, enum body_format format, size_t part, struct arena *out)
+{
+	if (format == FORMAT_PROTOBUF) {
+		encode_metrics_part(snap, part, out);
+	} else {
+		render_metrics_part(snap, format, part, out);
+	}
+}
+
+/* Body per station before a scrape with stations was rendered, a little
+ * over what one with every attribute takes in OpenMetrics */
+#define STATION_BODY_SIZE 8192
+
+static void body_size_store(const struct snapshot *snap, enum body_format format, size_t len)
+{
+	atomic_store(&shared->body_size[format], len);
+	if (snap->sta.count) {
+		atomic_store(&shared->station_size[format], len / snap->sta.count);
+	}
+}
+
+/* Whether the body of snap would not fit the scrape cache. Stations make
+ * up nearly all of it, so it is estimated from their number. */
+static bool body_too_large(const struct snapshot *snap, enum body_format format)
+{
+	size_t per_station = atomic_load(&shared->station_size[format]);
+	if (!per_station) {
+		per_station = STATION_BODY_SIZE;
+	}
+	return snap->sta.count > SCRAPE_CACHE_SIZE / per_station;
+}
+
+static int render_body(const struct snapshot *snap, enum body_format format, struct arena *out)
+{
+	out->len = 0;
+	out->failed = false;
+	arena_reserve(out, atomic_load(&shared->body_size[format]));
+	for (size_t part = 0; part < METRIC_PARTS; part++) {
+		render_part(snap, format, part, out);
+	}
+	if (out->failed) {
+		return -ENOMEM;
+	}
+	body_size_store(snap, format, out->len);
+	return 0;
+}
+
+/* A background thread collects the metrics, every collect_interval_ms or
+ * whenever the event loop asks for a snapshot. Readers hold the read lock
+ * of the snapshot they render from, a streamed response until its client
+ * took the last part. The collector only writes a snapshot that is neither
+ * published nor read locked, and adds one when all are in use, so slow
+ * clients never hold up a collection. */
+static struct snapshot **snapshots;
+static size_t snapshot_count;
+static size_t snapshot_alloc;
+static _Atomic(struct snapshot *) published;
+static atomic_int collect_error;	/* of the last collection */
+static unsigned int collect_interval_ms;
+
+/* Event counters, the loop asks for a collection on collect_wanted and the
+ * collector tells it about every finished one on collect_done */
+static int collect_wanted = -1;
+static int collect_done = -1;
+/* Formats the loop waits for, and the generation of the last collection
+ * it can answer them from */
+static atomic_uint formats_waiting;
+static pthread_mutex_t collected_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t collected_generation;
+
+/* A snapshot to collect into, write locked */
+static struct snapshot *snapshot_unused(void)
+{
+	struct snapshot *current = atomic_load(&published);
+	for (size_t i = 0; i < snapshot_count; i++) {
+		if (snapshots[i] != current && pthread_rwlock_trywrlock(&snapshots[i]->lock) == 0) {
+			return snapshots[i];
+		}
+	}
+	void *p = array_grow(snapshots, &snapshot_alloc, snapshot_count, sizeof(*snapshots));
+	if (!p) {
+		return NULL;
+	}
+	snapshots = p;
+	struct snapshot *snap = calloc(1, sizeof(*snap));
+	if (!snap) {
+		return NULL;
+	}
+	pthread_rwlock_init(&snap->lock, NULL);
+	pthread_rwlock_wrlock(&snap->lock);
+	snapshots[snapshot_count++] = snap;
+	return snap;
+}
+
+static void shared_collect_lock(void)
+{
+	if (pthread_mutex_lock(&shared->collect_lock) == EOWNERDEAD) {
+		/* The previous owner died, possibly before caching all bodies */
+		shared->collect_formats = 0;
+		pthread_mutex_consistent(&shared->collect_lock);
+	}
+}
+
+/* Cache the bodies other workers wait for, so they do not collect again */
+static void collect_share(const struct snapshot *snap, unsigned int formats)
+{
+	static struct arena shared_body;
+	unsigned int cached = 0;
+
+	formats |= atomic_exchange(&shared->formats_wanted, 0);
+	for (int format = 0; format < BODY_FORMATS; format++) {
+		if (!(formats & BIT(format)) || body_too_large(snap, (enum body_format)format)) {
+			continue;
+		}
+		if (render_body(snap, (enum body_format)format, &shared_body) == 0) {
+			cache_put(cache[format], shared_body.buf, shared_body.len, snap->generation);
+			cached |= (unsigned int)BIT(format);
+		}
+	}
+	shared->collect_formats = cached;
+	shared->collect_generation = snap->generation;
+	atomic_fetch_add(&shared->collections, 1);
+}
+
+static void collect_publish(void)
+{
+	unsigned int formats = atomic_exchange(&formats_waiting, 0);
+	uint64_t generation = 0;
+	int rv = 0;
+
+	if (share_collections) {
+		/* Whoever holds the lock collects for everyone waiting on it */
+		atomic_fetch_or(&shared->formats_wanted, formats);
+		unsigned int seen = atomic_load(&shared->collections);
+		shared_collect_lock();
+		if (atomic_load(&shared->collections) != seen &&
+		    (shared->collect_formats & formats) == formats) {
+			generation = shared->collect_generation;
+		}
+	}
+	struct snapshot *next = generation ? NULL : snapshot_unused();
+	if (next) {
+		rv = collect_metrics(next);
+		if (rv == 0 && share_collections) {
+			collect_share(next, formats);
+		}
+		generation = next->generation;
+		pthread_rwlock_unlock(&next->lock);
+		if (rv == 0) {
+			atomic_store(&published, next);
+		}
+	} else if (!generation) {
+		rv = -ENOMEM;
+	}
+	if (share_collections) {
+		pthread_mutex_unlock(&shared->collect_lock);
+	}
+	pthread_mutex_lock(&collected_lock);
+	collected_generation = generation;
+	pthread_mutex_unlock(&collected_lock);
+	atomic_store(&collect_error, rv);
+
+	uint64_t one = 1;
+	if (write(collect_done, &one, sizeof(one)) < 0) {
+		fprintf(stderr, "Failed to signal a collection: %s\n", strerror(errno));
+	}
+}
+
+static void *collector_thread(void *arg)
+{
+	UNUSED(arg);
+
+	for (;;) {
+		/* Follow station events until the next collection is due or asked for */
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += collect_interval_ms / 1000;
+		deadline.tv_nsec += (long)(collect_interval_ms % 1000) * 1000000;
+		for (bool wanted = false; !wanted;) {
+			int timeout = -1;
+			if (collect_interval_ms) {
+				int64_t left = -elapsed_ms(&deadline);
+				if (left <= 0) {
+					break;
+				}
+				timeout = (int)left;
+			}
+			int fd[2];
+			struct pollfd pfd[3];
+			int nfds = session_event_fds(fd);
+			for (int i = 0; i < nfds; i++) {
+				pfd[i].fd = fd[i];
+				pfd[i].events = POLLIN;
+			}
+			pfd[nfds].fd = collect_wanted;
+			pfd[nfds].events = POLLIN;
+			if (poll(pfd, (nfds_t)nfds + 1, timeout) > 0) {
+				session_events_process();
+				uint64_t n;
+				wanted = (pfd[nfds].revents & POLLIN) && read(collect_wanted, &n, sizeof(n)) > 0;
+			}
+		}
+
+		session_events_process();
+		collect_publish();
+	}
+	return NULL;
+}
+
+/* The published snapshot read locked, or NULL if there is none */
+static struct snapshot *snapshot_acquire(void)
+{
+	for (;;) {
+		struct snapshot *snap = atomic_load(&published);
+		/* Only a snapshot that is no longer published can be write
+		 * locked, the one published after it is free */
+		if (!snap || pthread_rwlock_tryrdlock(&snap->lock) == 0) {
+			return snap;
+		}
+	}
+}
+
+static void snapshot_release(struct snapshot *snap)
+{
+	if (snap) {
+		pthread_rwlock_unlock(&snap->lock);
+	}
+}
+
+/* Connections are kept open for this many requests, with at most this long
+ * between them */
+#define KEEPALIVE_REQUESTS 1000
+#define KEEPALIVE_IDLE_S 75
+
+/* What a response depends on besides its body */
+struct http_request {
+	bool http11;
+	bool keep_alive;	/* the connection stays open after the response */
+	bool gzip;
+	enum body_format format;
+	bool negotiated;	/* the body depends on Accept and Accept-Encoding */
+};
+
+/* Whether a comma separated header value lists token */
+static bool header_has(const char *value, const char *token)
+{
+	size_t token_len = strlen(token);
+	const char *p = value;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		size_t len = strcspn(p, " \t,;\r\n");
+		if (len == token_len && strncasecmp(p, token, len) == 0) {
+			return true;
+		}
+		p += strcspn(p, ",");
+	}
+	return false;
+}
+
+/* Status line and headers for a body of len bytes, or a chunked one */
+static int http_header(char *buf, size_t size, const struct http_request *req, const char *status,
+		const char *type, const char *encoding, bool chunked, size_t len)
+{
+	char length[48];
+
+	if (chunked) {
+		snprintf(length, sizeof(length), "Transfer-Encoding: chunked");
+	} else {
+		snprintf(length, sizeof(length), "Content-Length: %zu", len);
+	}
+	int n = snprintf(buf, size, "HTTP/1.%c %s\r\nContent-Type: %s\r\n%s%s%s%s%s\r\nConnection: %s\r\n\r\n",
+			req->http11 ? '1' : '0', status, type, encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+			encoding ? "\r\n" : "", req->negotiated ? "Vary: Accept, Accept-Encoding\r\n" : "",
+			length, req->keep_alive ? "keep-alive" : "close");
+	return n < (int)size ? n : -ENOBUFS;
+}
+
+/* A body in a sealed memory file. It is copied into the kernel once and
+ * every response of the same snapshot sends it from there with sendfile,
+ * the seals guarantee it stays the same while responses are in flight. */
+struct body_file {
+	bool valid;
+	int fd;
+	size_t len;
+	uint64_t generation;
+};
+
+/* Plain and compressed body of every format */
+static struct body_file body_files[BODY_FORMATS][2];
+
+static bool body_file_current(const struct body_file *f, uint64_t generation)
+{
+	return f->valid && generation && f->generation == generation;
+}
+
+static int body_file_set(struct body_file *f, const struct arena *content, uint64_t generation)
+{
+	int fd = memfd_create("body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return -errno;
+	}
+	for (size_t done = 0; done < content->len;) {
+		ssize_t n = write(fd, content->buf + done, content->len - done);
+		if (n < 0 && errno != EINTR) {
+			int err = errno;
+			close(fd);
+			return -err;
+		}
+		done += n > 0 ? (size_t)n : 0;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+	if (f->valid) {
+		close(f->fd);
+	}
+	f->valid = true;
+	f->fd = fd;
+	f->len = content->len;
+	f->generation = generation;
+	return 0;
+}
+
+/* Bodies too large for the scrape cache are streamed to HTTP/1.1 clients
+ * a few parts at a time, whenever the previous ones have been sent */
+#define STREAM_CHUNK (64 << 10)
+
+struct chunked {
+	bool gzip;
+	z_stream zs;
+	size_t part;		/* the next one to render */
+	size_t total;		/* before compression */
 };
 
-static int finish_handler(struct nl_msg *msg, void *arg)
+static void chunk_put(struct arena *out, const char *data, size_t len)
 {
-	UNUSED(msg);
-	int *err = arg;
-	*err = 0;
-	return NL_SKIP;
+	if (len) {
+		arena_printf(out, "%zx\r\n", len);
+		arena_put(out, data, len);
+		arena_puts(out, "\r\n");
+	}
 }
 
-static int survey_dump_handler(struct nl_msg *msg, void *arg)
+/* Append data as chunks, through the compressor if there is one */
+static int chunked_write(struct chunked *s, const char *data, size_t len, int flush, struct arena *out)
 {
-	struct nlattr *tb[NL80211_ATTR_MAX + 1];
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-	struct nlattr *sinfo[NL80211_SURVEY_INFO_MAX + 1];
-	struct client_context *ctx = (struct client_context *)arg;
-	FILE *stream = ctx->stream;
+	static char buf[STREAM_CHUNK];
 
-	static struct nla_policy survey_policy[NL80211_SURVEY_INFO_MAX + 1] = {
-		[NL80211_SURVEY_INFO_FREQUENCY] = { .type = NLA_U32 },
-		[NL80211_SURVEY_INFO_NOISE] = { .type = NLA_U8 },
-	};
+	if (!s->gzip) {
+		chunk_put(out, data, len);
+		return 0;
+	}
+	s->zs.next_in = (const Bytef *)data;
+	s->zs.avail_in = (uInt)len;
+	do {
+		s->zs.next_out = (Bytef *)buf;
+		s->zs.avail_out = sizeof(buf);
+		int rv = deflate(&s->zs, flush);
+		if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR) {
+			return -EIO;
+		}
+		chunk_put(out, buf, sizeof(buf) - s->zs.avail_out);
+	} while (s->zs.avail_out == 0);
+	return 0;
+}
 
-	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-		  genlmsg_attrlen(gnlh, 0), NULL);
+/* Requests are read into in until one is complete. The response is
+ * out[0, split), then file_len bytes of the file, then the rest of out. */
+#define REQUEST_SIZE 4096
 
-	char dev[IFNAMSIZ];
-	if_indextoname(nla_get_u32(tb[NL80211_ATTR_IFINDEX]), dev);
+/* Requests are parsed where they lie in the receive buffer. Every line is
+ * parsed once, as soon as it is complete, and NUL terminated in place.
+ * The fields point into the buffer until the request is answered. */
+enum parse_state {
+	PARSE_REQUEST_LINE,
+	PARSE_HEADERS,
+};
 
-	if (!tb[NL80211_ATTR_SURVEY_INFO]) {
-		fprintf(stderr, "survey data missing!\n");
-		return NL_SKIP;
-	}
+struct http_parser {
+	enum parse_state state;
+	size_t pos;		/* start of the first line not parsed yet */
+	/* NULL unless the request has them */
+	char *method;
+	char *path;
+	char *query;		/* after the '?' of the target */
+	char *protocol;
+	char *accept;
+	char *accept_encoding;
+	char *connection;
+};
 
-	if (nla_parse_nested(sinfo, NL80211_SURVEY_INFO_MAX,
-			     tb[NL80211_ATTR_SURVEY_INFO],
-			     survey_policy)) {
-		fprintf(stderr, "failed to parse nested attributes!\n");
-		return NL_SKIP;
-	}
-	bool active_freq = 0;
-	uint32_t cur_freq = 0;
-	if (sinfo[NL80211_SURVEY_INFO_FREQUENCY]) {
-		if (sinfo[NL80211_SURVEY_INFO_IN_USE]) {
-			active_freq = 1;
-		}
-		cur_freq = nla_get_u32(sinfo[NL80211_SURVEY_INFO_FREQUENCY]);
-	} else {
-		return NL_SKIP;
-	}
-	if (sinfo[NL80211_SURVEY_INFO_NOISE]) {
-		fprintf(stream, "wlan_survey_channel_noise_dbm{device=\"%s\",frequency=%u} %d\n",
-				dev, cur_freq, (int8_t)nla_get_u8(sinfo[NL80211_SURVEY_INFO_NOISE]));
-	}
-	if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME]) {
-		fprintf(stream, "wlan_survey_channel_active_ms{device=\"%s\",frequency=%u} %ju\n",
-				dev, cur_freq, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME]));
-	}
-	if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY]) {
-		fprintf(stream, "wlan_survey_channel_busy_ms{device=\"%s\",frequency=%u} %ju\n",
-				dev, cur_freq, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY]));
-	}
-	if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY]) {
-		fprintf(stream, "wlan_survey_channel_ext_busy_ms{device=\"%s\",frequency=%u} %ju\n",
-				dev, cur_freq, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY]));
-	}
-	if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_RX]) {
-		fprintf(stream,"wlan_survey_channel_rx_time_ms{device=\"%s\",frequency=%u} %ju\n",
-				dev, cur_freq, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_RX]));
-	}
-	if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_TX]) {
-		fprintf(stream, "wlan_survey_channel_tx_time_ms{device=\"%s\",frequency=%u} %ju\n",
-				dev, cur_freq, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_TX]));
-	}
-	if (active_freq) {
-		fprintf(stream, "wlan_active_frequency{device=\"%s\"} %ju\n",
-				dev, (uintmax_t)cur_freq);
-		if (sinfo[NL80211_SURVEY_INFO_NOISE]) {
-			fprintf(stream, "wlan_active_channel_noise_dbm{device=\"%s\"} %d\n",
-					dev, (int8_t)nla_get_u8(sinfo[NL80211_SURVEY_INFO_NOISE]));
-		}
-		if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME]) {
-			fprintf(stream, "wlan_active_channel_active_ms{device=\"%s\"} %ju\n",
-					dev, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME]));
-		}
-		if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY]) {
-			fprintf(stream, "wlan_active_channel_busy_ms{device=\"%s\"} %ju\n",
-					dev, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_BUSY]));
-		}
-		if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY]) {
-			fprintf(stream, "wlan_active_channel_ext_busy_ms{device=\"%s\"} %ju\n",
-					dev, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_EXT_BUSY]));
-		}
-		if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_RX]) {
-			fprintf(stream,"wlan_active_channel_rx_time_ms{device=\"%s\"} %ju\n",
-					dev, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_RX]));
-		}
-		if (sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_TX]) {
-			fprintf(stream, "wlan_active_channel_tx_time_ms{device=\"%s\"} %ju\n",
-					dev, (uintmax_t)nla_get_u64(sinfo[NL80211_SURVEY_INFO_CHANNEL_TIME_TX]));
-		}
+/* Split off the next space separated token of a line */
+static char *next_token(char **s)
+{
+	char *p = *s + strspn(*s, " \t");
+	if (!*p) {
+		return NULL;
 	}
-	return NL_SKIP;
+	char *end = p + strcspn(p, " \t");
+	*s = *end ? end + 1 : end;
+	*end = '\0';
+	return p;
 }
 
-static void print_bss_param(struct nlattr *bss_param_attr, FILE *stream, const char *dev, const char *sta)
+static void parse_request_line(struct http_parser *p, char *line)
 {
-	struct nlattr *info[NL80211_STA_BSS_PARAM_MAX + 1];
-	static struct nla_policy bss_policy[NL80211_STA_BSS_PARAM_MAX + 1] = {
-		[NL80211_STA_BSS_PARAM_CTS_PROT] = { .type = NLA_FLAG },
-		[NL80211_STA_BSS_PARAM_SHORT_PREAMBLE] = { .type = NLA_FLAG },
-		[NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME] = { .type = NLA_FLAG },
-		[NL80211_STA_BSS_PARAM_DTIM_PERIOD] = { .type = NLA_U8 },
-		[NL80211_STA_BSS_PARAM_BEACON_INTERVAL] = { .type = NLA_U16 },
-	};
-
-	if (nla_parse_nested(info, NL80211_STA_BSS_PARAM_MAX,
-			     bss_param_attr, bss_policy)) {
-		printf("failed to parse nested bss param attributes!");
+	p->method = next_token(&line);
+	char *target = p->method ? next_token(&line) : NULL;
+	p->protocol = target ? next_token(&line) : NULL;
+	if (target) {
+		p->path = target;
+		char *query = strchr(target, '?');
+		if (query) {
+			*query = '\0';
+			p->query = query + 1;
+		}
 	}
+}
 
-	if (info[NL80211_STA_BSS_PARAM_DTIM_PERIOD]) {
-		fprintf(stream, "wlan_station_bss_dtim_period{device=\"%s\",station=\"%s\"} %u\n",
-				dev, sta, nla_get_u8(info[NL80211_STA_BSS_PARAM_DTIM_PERIOD]));
-	}
-	if (info[NL80211_STA_BSS_PARAM_BEACON_INTERVAL]) {
-		fprintf(stream, "wlan_station_bss_beacon_interval{device=\"%s\",station=\"%s\"} %u\n",
-				dev, sta, nla_get_u16(info[NL80211_STA_BSS_PARAM_BEACON_INTERVAL]));
-	}
-	if (info[NL80211_STA_BSS_PARAM_CTS_PROT]) {
-		fprintf(stream, "wlan_station_bss_cts_protection{device=\"%s\",station=\"%s\"} %u\n",
-				dev, sta, nla_get_u16(info[NL80211_STA_BSS_PARAM_CTS_PROT]));
-	}
-	if (info[NL80211_STA_BSS_PARAM_SHORT_PREAMBLE]) {
-		fprintf(stream, "wlan_station_bss_short_preamble{device=\"%s\",station=\"%s\"} %u\n",
-				dev, sta, nla_get_u16(info[NL80211_STA_BSS_PARAM_SHORT_PREAMBLE]));
+static void parse_header(struct http_parser *p, char *line)
+{
+	char *colon = strchr(line, ':');
+	if (!colon) {
+		return;
 	}
-	if (info[NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME]) {
-		fprintf(stream, "wlan_station_bss_short_slot_time{device=\"%s\",station=\"%s\"} %u\n",
-				dev, sta, nla_get_u16(info[NL80211_STA_BSS_PARAM_SHORT_SLOT_TIME]));
+	*colon = '\0';
+	char *value = colon + 1 + strspn(colon + 1, " \t");
+	if (strcasecmp(line, "Accept") == 0) {
+		p->accept = value;
+	} else if (strcasecmp(line, "Accept-Encoding") == 0) {
+		p->accept_encoding = value;
+	} else if (strcasecmp(line, "Connection") == 0) {
+		p->connection = value;
 	}
 }
 
-static void print_tid_stats(struct nlattr *tid_stats_attr, FILE *stream, const char *dev, const char *sta)
+/* Parse the lines of buf[0, len) that became complete since the last call.
+ * Returns the length of the request once its empty line is in, 0 before. */
+static size_t http_parse(struct http_parser *p, char *buf, size_t len)
 {
-	struct nlattr *stats_info[NL80211_TID_STATS_MAX + 1], *tidattr;
-	static struct nla_policy stats_policy[NL80211_TID_STATS_MAX + 1] = {
-		[NL80211_TID_STATS_RX_MSDU] = { .type = NLA_U64 },
-		[NL80211_TID_STATS_TX_MSDU] = { .type = NLA_U64 },
-		[NL80211_TID_STATS_TX_MSDU_RETRIES] = { .type = NLA_U64 },
-		[NL80211_TID_STATS_TX_MSDU_FAILED] = { .type = NLA_U64 },
-	};
-	int rem, i = 0;
+	char *nl;
 
-	nla_for_each_nested(tidattr, tid_stats_attr, rem) {
-		if (nla_parse_nested(stats_info, NL80211_TID_STATS_MAX,
-				     tidattr, stats_policy)) {
-			fprintf(stderr, "failed to parse nested stats attributes!");
-			return;
-		}
-		if (stats_info[NL80211_TID_STATS_RX_MSDU]) {
-			fprintf(stream, "wlan_station_tid_rx_msdu{device=\"%s\",station=\"%s\",tid=%d} %ju\n",
-					dev, sta, i, (uintmax_t)nla_get_u64(stats_info[NL80211_TID_STATS_RX_MSDU]));
+	while ((nl = memchr(buf + p->pos, '\n', len - p->pos))) {
+		char *line = buf + p->pos;
+		p->pos = (size_t)(nl + 1 - buf);
+		if (nl > line && nl[-1] == '\r') {
+			nl--;
 		}
-		if (stats_info[NL80211_TID_STATS_TX_MSDU]) {
-			fprintf(stream, "wlan_station_tid_tx_msdu{device=\"%s\",station=\"%s\",tid=%d} %ju\n",
-					dev, sta, i, (uintmax_t)nla_get_u64(stats_info[NL80211_TID_STATS_TX_MSDU]));
-		}
-		if (stats_info[NL80211_TID_STATS_TX_MSDU_RETRIES]) {
-			fprintf(stream, "wlan_station_tid_tx_msdu_retries{device=\"%s\",station=\"%s\",tid=%d} %ju\n",
-					dev, sta, i, (uintmax_t)nla_get_u64(stats_info[NL80211_TID_STATS_TX_MSDU_RETRIES]));
-		}
-		if (stats_info[NL80211_TID_STATS_TX_MSDU_FAILED]) {
-			fprintf(stream, "wlan_station_tid_tx_msdu_failed{device=\"%s\",station=\"%s\",tid=%d} %ju\n",
-					dev, sta, i, (uintmax_t)nla_get_u64(stats_info[NL80211_TID_STATS_TX_MSDU_FAILED]));
+		*nl = '\0';
+		if (p->state == PARSE_REQUEST_LINE) {
+			/* Empty lines ahead of a request are ignored */
+			if (*line) {
+				parse_request_line(p, line);
+				p->state = PARSE_HEADERS;
+			}
+		} else if (!*line) {
+			return p->pos;
+		} else {
+			parse_header(p, line);
 		}
-		i++;
 	}
+	return 0;
 }
 
-static void print_bitrate(struct nlattr *bitrate_attr, const char *direction, FILE *stream, const char *dev, const char *sta)
+/* Value of a query parameter, not terminated, and its length */
+static const char *query_param(const char *query, const char *name, size_t *len)
 {
-	struct nlattr *rinfo[NL80211_RATE_INFO_MAX + 1];
-	static struct nla_policy rate_policy[NL80211_RATE_INFO_MAX + 1] = {
-		[NL80211_RATE_INFO_BITRATE] = { .type = NLA_U16 },
-		[NL80211_RATE_INFO_BITRATE32] = { .type = NLA_U32 },
-		[NL80211_RATE_INFO_MCS] = { .type = NLA_U8 },
-		[NL80211_RATE_INFO_VHT_MCS] = { .type = NLA_U8 },
-		[NL80211_RATE_INFO_40_MHZ_WIDTH] = { .type = NLA_FLAG },
-		[NL80211_RATE_INFO_SHORT_GI] = { .type = NLA_FLAG },
-	};
-
-	if (nla_parse_nested(rinfo, NL80211_RATE_INFO_MAX,
-			     bitrate_attr, rate_policy)) {
-		fprintf(stderr, "failed to parse nested rate attributes!");
-		return;
-	}
+	size_t name_len = strlen(name);
 
-	if (rinfo[NL80211_RATE_INFO_BITRATE32]) {
-		fprintf(stream, "wlan_station_%s_bitrate{device=\"%s\",station=\"%s\"} %ju\n",
-				direction, dev, sta, (uintmax_t)nla_get_u32(rinfo[NL80211_RATE_INFO_BITRATE32]) * 100000);
-	} else if (rinfo[NL80211_RATE_INFO_BITRATE]) {
-		fprintf(stream, "wlan_station_%s_bitrate{device=\"%s\",station=\"%s\"} %ju\n",
-				direction, dev, sta, (uintmax_t)nla_get_u16(rinfo[NL80211_RATE_INFO_BITRATE]) * 100000);
-	}
-	if (rinfo[NL80211_RATE_INFO_MCS]) {
-		fprintf(stream, "wlan_station_%s_bitrate_mcs{device=\"%s\",station=\"%s\"} %ju\n",
-				direction, dev, sta, (uintmax_t)nla_get_u8(rinfo[NL80211_RATE_INFO_MCS]));
-	}
-	if (rinfo[NL80211_RATE_INFO_VHT_MCS]) {
-		fprintf(stream, "wlan_station_%s_bitrate_vht_mcs{device=\"%s\",station=\"%s\"} %ju\n",
-				direction, dev, sta, (uintmax_t)nla_get_u8(rinfo[NL80211_RATE_INFO_VHT_MCS]));
-	}
-	uint8_t channel_width;
-	if (rinfo[NL80211_RATE_INFO_160_MHZ_WIDTH]) {
-		channel_width = 160;
-	} else if (rinfo[NL80211_RATE_INFO_80P80_MHZ_WIDTH]) {
-		channel_width = 160; /* FIXME: Need way of telling controller that this is 80+80, not 160
-		                             But then again.. nobody should be using 160MHz wide channels anyway */
-	} else if (rinfo[NL80211_RATE_INFO_80_MHZ_WIDTH]) {
-		channel_width = 80;
-	} else if (rinfo[NL80211_RATE_INFO_40_MHZ_WIDTH]) {
-		channel_width = 40;
-	} else {
-		channel_width = 20;
-	}
-	fprintf(stream, "wlan_station_%s_bitrate_channel_width{device=\"%s\",station=\"%s\"} %u\n",
-			direction, dev, sta, channel_width);
-
-	fprintf(stream, "wlan_station_%s_bitrate_short_gi{device=\"%s\",station=\"%s\"} %d\n",
-			direction, dev, sta, rinfo[NL80211_RATE_INFO_SHORT_GI] ? 1 : 0);
-
-	if (rinfo[NL80211_RATE_INFO_VHT_NSS]) {
-		fprintf(stream, "wlan_station_%s_bitrate_vht_nss{device=\"%s\",station=\"%s\"} %u\n",
-				direction, dev, sta, nla_get_u8(rinfo[NL80211_RATE_INFO_VHT_NSS]));
+	while (query && *query) {
+		size_t param = strcspn(query, "&");
+		if (param > name_len && strncmp(query, name, name_len) == 0 && query[name_len] == '=') {
+			*len = param - name_len - 1;
+			return query + name_len + 1;
+		}
+		query += param;
+		query += *query == '&';
 	}
+	return NULL;
 }
 
+enum conn_state {
+	CONN_READ,		/* waiting for a complete request */
+	CONN_COLLECT,		/* waiting for a snapshot */
+	CONN_WRITE,		/* sending the response */
+};
 
-static void print_chain_signal(struct nlattr *attr_list, const char *metric_name, FILE *stream, const char *dev, const char *sta)
-{
-	struct nlattr *attr;
-	int i = 0, rem;
+struct conn {
+	int fd;
+	enum conn_state state;
+	int requests;		/* answered so far */
+	bool eof;		/* the client sends nothing more */
+	struct timespec active;	/* last progress, CLOCK_MONOTONIC */
+	struct http_request req;
+	struct http_parser parser;
+	size_t in_len;
+	char in[REQUEST_SIZE];
+	struct arena out;
+	size_t sent;
+	size_t split;
+	int file;		/* -1 if there is none */
+	off_t file_off;
+	size_t file_len;
+	/* A streamed response holds the snapshot it is rendered from */
+	struct snapshot *snap;
+	struct chunked *stream;
+};
 
-	if (!attr_list)
-		return;
+/* Connections by socket, epoll events carry the fd */
+static struct conn **conns;
+static size_t conns_alloc;
+static int conns_open;
+static int epollfd = -1;
+/* Connections beyond this many per worker are refused */
+static int max_connections = 64;
+static bool collect_pending;
 
-	nla_for_each_nested(attr, attr_list, rem) {
-		fprintf(stream, "%s{device=\"%s\",station=\"%s\",chain=%d} %d\n",
-			metric_name, dev, sta, i, (int8_t) nla_get_u8(attr));
-		i++;
-	}
+static void conn_watch(struct conn *c, uint32_t events)
+{
+	struct epoll_event ev = {0};
+	ev.events = events;
+	ev.data.fd = c->fd;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
 }
 
-static int station_dump_handler(struct nl_msg *msg, void *arg)
+static struct conn *conn_new(int fd)
 {
-	struct client_context *ctx = (struct client_context *)arg;
-	struct nlattr *tb_msg[NL80211_ATTR_MAX + 1];
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-	struct nlattr *sinfo[NL80211_STA_INFO_MAX + 1];
-	static struct nla_policy stats_policy[NL80211_STA_INFO_MAX + 1] = {
-		[NL80211_STA_INFO_CONNECTED_TIME] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_INACTIVE_TIME] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_RX_BYTES] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_TX_BYTES] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_RX_BYTES64] = { .type = NLA_U64 },
-		[NL80211_STA_INFO_TX_BYTES64] = { .type = NLA_U64 },
-		[NL80211_STA_INFO_RX_PACKETS] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_TX_PACKETS] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_BEACON_RX] = { .type = NLA_U64},
-		[NL80211_STA_INFO_SIGNAL] = { .type = NLA_U8 },
-		[NL80211_STA_INFO_T_OFFSET] = { .type = NLA_U64 },
-		[NL80211_STA_INFO_TX_BITRATE] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_RX_BITRATE] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_TX_RETRIES] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_TX_FAILED] = { .type = NLA_U32 },
-		[NL80211_STA_INFO_BEACON_LOSS] = { .type = NLA_U32},
-		[NL80211_STA_INFO_RX_DROP_MISC] = { .type = NLA_U64},
-		[NL80211_STA_INFO_STA_FLAGS] =
-	{ .minlen = sizeof(struct nl80211_sta_flag_update) },
-		[NL80211_STA_INFO_CHAIN_SIGNAL] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_CHAIN_SIGNAL_AVG] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_TID_STATS] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_BSS_PARAM] = { .type = NLA_NESTED },
-		[NL80211_STA_INFO_RX_DURATION] = { .type = NLA_U64 },
-	};
-	nla_parse(tb_msg, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-			genlmsg_attrlen(gnlh, 0), NULL);
-
-	if (!tb_msg[NL80211_ATTR_STA_INFO]) {
-		fprintf(stderr, "sta stats missing!\n");
-		return NL_SKIP;
-	}
-	if (nla_parse_nested(sinfo, NL80211_STA_INFO_MAX,
-				tb_msg[NL80211_ATTR_STA_INFO],
-				stats_policy)) {
-		fprintf(stderr, "failed to parse nested attributes!\n");
-		return NL_SKIP;
-	}
-	char dev[IFNAMSIZ];
-	if_indextoname(nla_get_u32(tb_msg[NL80211_ATTR_IFINDEX]), dev);
-
-	char sta[ETH_ALEN*3];
-	snprintf(sta, ETH_ALEN*3, "%02x:%02x:%02x:%02x:%02x:%02x",
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[0],
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[1],
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[2],
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[3],
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[4],
-			((uint8_t *)nla_data(tb_msg[NL80211_ATTR_MAC]))[5]);
-	FILE *stream = ctx->stream;
-
-	int ifpos = -1;
-	for (int i = 0;i < ctx->if_count; i++) {
-		if (ctx->if_index[i] == nla_get_u32(tb_msg[NL80211_ATTR_IFINDEX])) {
-			ifpos = i;
-			break;
+	if ((size_t)fd >= conns_alloc) {
+		size_t alloc = conns_alloc ? conns_alloc : 64;
+		while (alloc <= (size_t)fd) {
+			alloc *= 2;
 		}
+		void *p = realloc(conns, alloc * sizeof(*conns));
+		if (!p) {
+			return NULL;
+		}
+		conns = p;
+		memset(conns + conns_alloc, 0, (alloc - conns_alloc) * sizeof(*conns));
+		conns_alloc = alloc;
 	}
-	if (ifpos == -1) {
-		fprintf(stderr, "Failed to find this interface in the context.\n");
-		return NL_SKIP;
+	struct conn *c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
 	}
-	ctx->if_num_sta[ifpos]++;
+	c->fd = fd;
+	c->file = -1;
+	clock_gettime(CLOCK_MONOTONIC, &c->active);
 
-	if (sinfo[NL80211_STA_INFO_CONNECTED_TIME]) {
-		fprintf(stream, "wlan_station_connected_time_s{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_CONNECTED_TIME]));
-	}
-	if (sinfo[NL80211_STA_INFO_INACTIVE_TIME]) {
-		fprintf(stream, "wlan_station_inactive_time_ms{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_INACTIVE_TIME]));
-	}
-	if (sinfo[NL80211_STA_INFO_RX_BYTES64]) {
-		fprintf(stream, "wlan_station_rx_bytes{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u64(sinfo[NL80211_STA_INFO_RX_BYTES64]));
-	}
-	else if (sinfo[NL80211_STA_INFO_RX_BYTES]) {
-		fprintf(stream, "wlan_station_rx_bytes{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_RX_BYTES]));
-	}
-	if (sinfo[NL80211_STA_INFO_RX_PACKETS]) {
-		fprintf(stream, "wlan_station_rx_packets{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_RX_PACKETS]));
-	}
-	if (sinfo[NL80211_STA_INFO_TX_BYTES64]) {
-		fprintf(stream, "wlan_station_tx_bytes{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u64(sinfo[NL80211_STA_INFO_TX_BYTES64]));
-	} else if (sinfo[NL80211_STA_INFO_TX_BYTES]) {
-		fprintf(stream, "wlan_station_tx_bytes{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_TX_BYTES]));
-	}
-	if (sinfo[NL80211_STA_INFO_TX_PACKETS]) {
-		fprintf(stream, "wlan_station_tx_packets{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_TX_PACKETS]));
-	}
-	if (sinfo[NL80211_STA_INFO_TX_RETRIES]) {
-		fprintf(stream, "wlan_station_tx_retries{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_TX_RETRIES]));
-	}
-	if (sinfo[NL80211_STA_INFO_TX_FAILED]) {
-		fprintf(stream, "wlan_station_tx_failed{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_TX_FAILED]));
-	}
-	if (sinfo[NL80211_STA_INFO_BEACON_LOSS]) {
-		fprintf(stream, "wlan_station_beacon_loss{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_BEACON_LOSS]));
-	}
-	if (sinfo[NL80211_STA_INFO_BEACON_RX]) {
-		fprintf(stream, "wlan_station_rx_beacons{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_BEACON_RX]));
-	}
-	if (sinfo[NL80211_STA_INFO_RX_DROP_MISC]) {
-		fprintf(stream, "wlan_station_rx_drop_misc{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_RX_DROP_MISC]));
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(c);
+		return NULL;
 	}
+	conns[fd] = c;
+	conns_open++;
+	return c;
+}
 
-	print_chain_signal(sinfo[NL80211_STA_INFO_CHAIN_SIGNAL], "wlan_station_chain_signal_dbm", stream, dev, sta);
-	if (sinfo[NL80211_STA_INFO_SIGNAL]) {
-		fprintf(stream, "wlan_station_signal_dbm{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, (int8_t)nla_get_u8(sinfo[NL80211_STA_INFO_SIGNAL]));
-	}
-	print_chain_signal(sinfo[NL80211_STA_INFO_CHAIN_SIGNAL_AVG], "wlan_station_chain_signal_avg_dbm", stream, dev, sta);
-	if (sinfo[NL80211_STA_INFO_SIGNAL_AVG]) {
-		fprintf(stream, "wlan_station_signal_avg_dbm{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, (int8_t)nla_get_u8(sinfo[NL80211_STA_INFO_SIGNAL_AVG]));
+static void conn_stream_end(struct conn *c)
+{
+	if (c->stream) {
+		if (c->stream->gzip) {
+			deflateEnd(&c->stream->zs);
+		}
+		free(c->stream);
+		c->stream = NULL;
 	}
+	snapshot_release(c->snap);
+	c->snap = NULL;
+}
 
-	if (sinfo[NL80211_STA_INFO_BEACON_SIGNAL_AVG]) {
-		fprintf(stream, "wlan_station_beacon_signal_avg_dbm{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, (int8_t)nla_get_u8(sinfo[NL80211_STA_INFO_SIGNAL_AVG]));
-	}
-	if (sinfo[NL80211_STA_INFO_T_OFFSET]) {
-		fprintf(stream, "wlan_station_time_offset_ms{device=\"%s\",station=\"%s\"} %jd\n",
-				dev, sta, (intmax_t)nla_get_u64(sinfo[NL80211_STA_INFO_T_OFFSET]));
+/* Forget the response that was sent, keeping the buffer */
+static void conn_reset(struct conn *c)
+{
+	conn_stream_end(c);
+	if (c->file >= 0) {
+		close(c->file);
 	}
+	c->file = -1;
+	c->file_off = 0;
+	c->file_len = 0;
+	c->out.len = 0;
+	c->out.failed = false;
+	c->sent = 0;
+	c->split = 0;
+}
 
-	if (sinfo[NL80211_STA_INFO_TX_BITRATE]) {
-		print_bitrate(sinfo[NL80211_STA_INFO_TX_BITRATE], "tx", stream, dev, sta);
-	}
+static void conn_close(struct conn *c)
+{
+	conn_reset(c);
+	free(c->out.buf);
+	conns[c->fd] = NULL;
+	conns_open--;
+	close(c->fd);
+	free(c);
+}
 
-	if (sinfo[NL80211_STA_INFO_RX_BITRATE]) {
-		print_bitrate(sinfo[NL80211_STA_INFO_RX_BITRATE], "rx", stream, dev, sta);
+/* Start a response, the header goes into out */
+static void conn_header(struct conn *c, const char *status, const char *type, const char *encoding,
+		bool chunked, size_t len)
+{
+	char *p = arena_reserve(&c->out, 512);
+	int n = p ? http_header(p, 512, &c->req, status, type, encoding, chunked, len) : -ENOMEM;
+	if (n < 0) {
+		c->out.failed = true;
+		return;
 	}
+	c->out.len += (size_t)n;
+	c->split = c->out.len;
+	c->state = CONN_WRITE;
+}
+
+static void conn_respond(struct conn *c, const char *status, const char *type, const char *encoding,
+		const char *content, size_t len)
+{
+	conn_header(c, status, type, encoding, false, len);
+	arena_put(&c->out, content, len);
+	c->split = c->out.len;
+}
 
-	if (sinfo[NL80211_STA_INFO_RX_DURATION]) {
-		fprintf(stream, "wlan_station_rx_duration{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u64(sinfo[NL80211_STA_INFO_RX_DURATION]));
+/* Header, the file and what follows it. The file is shared with the
+ * responses of other connections, each holds a descriptor of its own. */
+static int conn_respond_file(struct conn *c, const char *status, const char *type, const char *encoding,
+		const struct body_file *f, const char *tail, size_t tail_len)
+{
+	c->file = fcntl(f->fd, F_DUPFD_CLOEXEC, 0);
+	if (c->file < 0) {
+		return -errno;
 	}
+	c->file_len = f->len;
+	conn_header(c, status, type, encoding, false, f->len + tail_len);
+	arena_put(&c->out, tail, tail_len);
+	return 0;
+}
 
-	if (sinfo[NL80211_STA_INFO_EXPECTED_THROUGHPUT]) {
-		fprintf(stream, "wlan_station_expected_throughput{device=\"%s\",station=\"%s\"} %ju\n",
-				dev, sta, (uintmax_t)nla_get_u32(sinfo[NL80211_STA_INFO_EXPECTED_THROUGHPUT]) * 1000);
+/* Render straight to the client, for bodies too large to buffer */
+static void conn_stream(struct conn *c, struct snapshot *snap)
+{
+	c->stream = calloc(1, sizeof(*c->stream));
+	if (!c->stream) {
+		conn_respond(c, "503 Service Unavailable", "text/plain", NULL, NULL, 0);
+		return;
 	}
+	c->stream->gzip = c->req.gzip &&
+		deflateInit2(&c->stream->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	/* The read lock is held until the last part is rendered */
+	pthread_rwlock_rdlock(&snap->lock);
+	c->snap = snap;
+	conn_header(c, "200 OK", format_type[c->req.format], c->stream->gzip ? "gzip" : NULL, true, 0);
+}
 
-	if (sinfo[NL80211_STA_INFO_STA_FLAGS]) {
-		struct nl80211_sta_flag_update *sta_flags = (struct nl80211_sta_flag_update *)
-			    nla_data(sinfo[NL80211_STA_INFO_STA_FLAGS]);
+/* Render the next parts of a streamed response into out, once the
+ * previous ones are sent */
+static int conn_stream_more(struct conn *c)
+{
+	static struct arena text;
+	struct chunked *s = c->stream;
+	enum body_format format = c->req.format;
 
-		fprintf(stream, "wlan_station_authorized{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_AUTHORIZED)));
-		fprintf(stream, "wlan_station_authenticated{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_AUTHENTICATED)));
-		fprintf(stream, "wlan_station_associated{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_ASSOCIATED)));
-		fprintf(stream, "wlan_station_short_preamble{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_SHORT_PREAMBLE)));
-		fprintf(stream, "wlan_station_wme{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_WME)));
-		fprintf(stream, "wlan_station_mfp{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_MFP)));
-		fprintf(stream, "wlan_station_tdls_peer{device=\"%s\",station=\"%s\"} %d\n",
-				dev, sta, !!(sta_flags->set & BIT(NL80211_STA_FLAG_TDLS_PEER)));
+	c->out.len = 0;
+	c->sent = 0;
+	c->split = 0;
+	while (!c->out.len && c->snap) {
+		text.len = 0;
+		text.failed = false;
+		while (s->part < METRIC_PARTS && text.len < STREAM_CHUNK) {
+			render_part(c->snap, format, s->part++, &text);
+		}
+		bool last = s->part == METRIC_PARTS;
+		if (last) {
+			render_tail(format, 0, &text);
+		}
+		s->total += text.len;
+		if (text.failed || chunked_write(s, text.buf, text.len, last ? Z_FINISH : Z_NO_FLUSH, &c->out)) {
+			return -ENOMEM;
+		}
+		if (last) {
+			arena_puts(&c->out, "0\r\n\r\n");
+			body_size_store(c->snap, format, s->total);
+			conn_stream_end(c);
+		}
 	}
+	c->split = c->out.len;
+	return c->out.failed ? -ENOMEM : 0;
+}
 
-	if (sinfo[NL80211_STA_INFO_TID_STATS]) {
-		print_tid_stats(sinfo[NL80211_STA_INFO_TID_STATS], stream, dev, sta);
-	}
-	if (sinfo[NL80211_STA_INFO_BSS_PARAM]) {
-		print_bss_param(sinfo[NL80211_STA_INFO_BSS_PARAM], stream, dev, sta);
+/* The metrics, from the cache or a snapshot. False if neither is of the
+ * wanted generation. */
+/* Copy the cached body of generation into body, unless it is there */
+static bool body_load(enum body_format format, uint64_t generation, bool *loaded)
+{
+	if (!*loaded) {
+		*loaded = cache_copy(cache[format], generation, &body);
 	}
-	return NL_SKIP;
+	return *loaded;
 }
 
-
-static int list_interface_handler(struct nl_msg *in_msg, void *arg)
+static bool conn_metrics(struct conn *c, struct snapshot *snap, uint64_t wanted)
 {
-	struct nlattr *tb_msg[NL80211_ATTR_MAX + 1];
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(in_msg));
-	struct client_context *ctx = (struct client_context *)arg;
-
-	nla_parse(tb_msg, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-			genlmsg_attrlen(gnlh, 0), NULL);
-
-	if (!tb_msg[NL80211_ATTR_IFINDEX]) {
-		return NL_SKIP;
+	enum body_format format = c->req.format;
+	int64_t age_ms = 0;
+	uint64_t generation = 0;
+	bool hit = cache_lookup(cache[format], wanted, &age_ms, &generation);
+	/* A cached body only passes through body when the file responses
+	 * are sent from has to be made again */
+	bool loaded = false;
+	if (hit && !body_file_current(&body_files[format][c->req.gzip], generation)) {
+		hit = body_load(format, generation, &loaded);
 	}
-	ctx->if_index[ctx->if_count] = nla_get_u32(tb_msg[NL80211_ATTR_IFINDEX]);
-	ctx->if_count++;
-	
-	char dev[IFNAMSIZ];
-	if_indextoname(nla_get_u32(tb_msg[NL80211_ATTR_IFINDEX]), dev);
-	if (tb_msg[NL80211_ATTR_WIPHY_TX_POWER_LEVEL]) {
-		uint32_t txp = nla_get_u32(tb_msg[NL80211_ATTR_WIPHY_TX_POWER_LEVEL]);
-		fprintf(ctx->stream, "wlan_interface_tx_power_dbm{device=\"%s\"} %jd.%ju\n",
-				dev, (intmax_t)(txp / 100), (uintmax_t)(txp % 100));
+	if (!hit) {
+		if (wanted && (!snap || snap->generation < wanted)) {
+			return false;
+		}
+		if (snap && c->req.http11 && body_too_large(snap, format)) {
+			conn_stream(c, snap);
+			return true;
+		}
+		if (!snap || render_body(snap, format, &body)) {
+			conn_respond(c, "503 Service Unavailable", "text/plain", NULL, NULL, 0);
+			return true;
+		}
+		age_ms = 0;
+		generation = snap->generation;
+		loaded = true;
+		cache_put(cache[format], body.buf, body.len, generation);
 	}
+	static struct arena tail;
+	tail.len = 0;
+	render_tail(format, age_ms, &tail);
 
-	return NL_SKIP;
-}
-
-int show_metrics(FILE *stream) {
-	/* Set up the netlink socket */
-	struct client_context ctx = {0};
-	ctx.stream = stream;
-	ctx.nls = nl_socket_alloc();
-	if (!ctx.nls) {
-		return -ENOLINK;
-	}
-	nl_socket_set_buffer_size(ctx.nls, 16384, 16384);
-	if (genl_connect(ctx.nls)) {
-		fprintf(stderr, "Failed to connect to generic netlink.\n");
-		nl_socket_free(ctx.nls);
-		return -ENOLINK;
-	}
-	ctx.nl80211_id = genl_ctrl_resolve(ctx.nls, "nl80211");
-	if (ctx.nl80211_id < 0) {
-		fprintf(stderr, "nl80211 not found.\n");
-		nl_socket_free(ctx.nls);
-		return -ENOENT;
-	}
-
-	struct nl_msg *msg = nlmsg_alloc();
-	if (!msg) {
-		fprintf(stderr, "Failed to allocate netlink message.\n");
-		nl_socket_free(ctx.nls);
-		return -ENOMEM;
+	/* The tail goes into a gzip member of its own, so the compressed
+	 * body can be shared. Decoders concatenate members. */
+	static struct arena compressed, gzip_tail;
+	struct arena *content = &body, *end = &tail;
+	const char *encoding = NULL;
+	/* A current compressed body file makes compressing unnecessary */
+	bool compress_skipped = false;
+	if (c->req.gzip) {
+		gzip_tail.len = 0;
+		compress_skipped = body_file_current(&body_files[format][1], generation);
+		if ((compress_skipped || gzip_body(gzip_cache[format], &body, generation, &compressed) == 0) &&
+		    (!tail.len || gzip_append(tail.buf, tail.len, &gzip_tail) == 0)) {
+			content = &compressed;
+			end = &gzip_tail;
+			encoding = "gzip";
+		}
 	}
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_CUSTOM);
-	if (!cb) {
-		fprintf(stderr, "Failed to allocate netlink callback.\n");
-		nlmsg_free(msg);
-		nl_socket_free(ctx.nls);
-		return -ENOMEM;
+	struct body_file *file = &body_files[format][encoding != NULL];
+	if ((body_file_current(file, generation) ||
+	     (body_load(format, generation, &loaded) && body_file_set(file, content, generation) == 0)) &&
+	    conn_respond_file(c, "200 OK", format_type[format], encoding, file, end->buf, end->len) == 0) {
+		return true;
 	}
+	/* Without memfd support the body is copied, compressed first if
+	 * that was left to the file */
+	if (!body_load(format, generation, &loaded) ||
+	    (encoding && compress_skipped && gzip_body(gzip_cache[format], &body, generation, &compressed))) {
+		conn_respond(c, "503 Service Unavailable", "text/plain", NULL, NULL, 0);
+		return true;
+	}
+	conn_header(c, "200 OK", format_type[format], encoding, false, content->len + end->len);
+	arena_put(&c->out, content->buf, content->len);
+	arena_put(&c->out, end->buf, end->len);
+	c->split = c->out.len;
+	return true;
+}
 
-	/* Send a GET_INTERFACE command */
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, list_interface_handler, &ctx);
-	genlmsg_put(msg, 0, 0, ctx.nl80211_id, 0, NLM_F_DUMP, NL80211_CMD_GET_INTERFACE, 0);
-	nl_send_auto_complete(ctx.nls, msg);
-
-	/* Wait for shit to finish */
-	int err = 1;
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-	while (err > 0) {
-		int rv = nl_recvmsgs(ctx.nls, cb);
-		if (rv != 0) {
-			fprintf(stderr, "Failed to receive netlink message: %s", strerror(-rv));
-
-			/* Free the shite */
-			nlmsg_free(msg);
-			nl_cb_put(cb);
-			return rv;
+/* Scrapes wait for the collector unless the cache or the background
+ * collection already has what they need */
+static void conn_metrics_request(struct conn *c)
+{
+	if (!collect_interval_ms && !cache_fresh(cache[c->req.format])) {
+		c->state = CONN_COLLECT;
+		atomic_fetch_or(&formats_waiting, (unsigned int)BIT(c->req.format));
+		if (!collect_pending) {
+			uint64_t one = 1;
+			if (write(collect_wanted, &one, sizeof(one)) < 0) {
+				fprintf(stderr, "Failed to request a collection: %s\n", strerror(errno));
+			}
+			collect_pending = true;
 		}
+		return;
 	}
+	struct snapshot *snap = snapshot_acquire();
+	conn_metrics(c, snap, 0);
+	snapshot_release(snap);
+}
 
-	/* Free the shite */
-	nlmsg_free(msg);
-	nl_cb_put(cb);
+/* Answer every scrape that waited for the collection that just finished.
+ * One that came in too late to have its format cached by another worker
+ * waits for the next one. */
+static void conns_collected(void)
+{
+	bool failed = atomic_load(&collect_error) != 0;
+	struct snapshot *snap = failed ? NULL : snapshot_acquire();
+	pthread_mutex_lock(&collected_lock);
+	uint64_t generation = failed ? 0 : collected_generation;
+	pthread_mutex_unlock(&collected_lock);
 
-	for (int i = 0; i < ctx.if_count; i++) {
-		/* Allocate new message */
-		msg = nlmsg_alloc();
-		if (!msg) {
-			fprintf(stderr, "Failed to allocate netlink message.\n");
-			nl_socket_free(ctx.nls);
-			return -ENOMEM;
+	collect_pending = false;
+	for (size_t fd = 0; fd < conns_alloc; fd++) {
+		struct conn *c = conns[fd];
+		if (!c || c->state != CONN_COLLECT) {
+			continue;
 		}
-		cb = nl_cb_alloc(NL_CB_CUSTOM);
-		if (!cb) {
-			fprintf(stderr, "Failed to allocate netlink callback.\n");
-			nlmsg_free(msg);
-			nl_socket_free(ctx.nls);
-			return -ENOMEM;
+		if (conn_metrics(c, snap, generation)) {
+			conn_watch(c, EPOLLOUT);
+		} else {
+			conn_metrics_request(c);
 		}
+	}
+	snapshot_release(snap);
+}
 
-		/* Send a GET_STATION command */
-		nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, station_dump_handler, &ctx);
-		genlmsg_put(msg, 0, 0, ctx.nl80211_id, 0, NLM_F_DUMP, NL80211_CMD_GET_STATION, 0);
-		nla_put_u32(msg, NL80211_ATTR_IFINDEX, ctx.if_index[i]);
-		nl_send_auto_complete(ctx.nls, msg);
+/* Names of the formats for the format query parameter, which overrides
+ * the Accept header */
+static const char *const format_name[BODY_FORMATS] = {
+	[FORMAT_TEXT] = "text",
+	[FORMAT_PROTOBUF] = "protobuf",
+	[FORMAT_OPENMETRICS] = "openmetrics",
+};
 
+/* Answer a parsed request */
+static void conn_request(struct conn *c, const struct http_parser *p)
+{
+	memset(&c->req, 0, sizeof(c->req));
+	if (!p->method || !p->path || !p->protocol || strncmp(p->protocol, "HTTP/1.", 7) != 0) {
+		conn_respond(c, "400 Bad Request", "text/plain", NULL, NULL, 0);
+		return;
+	}
+	if (strcmp(p->method, "GET") != 0) {
+		conn_respond(c, "405 Method Not Allowed", "text/plain", NULL, NULL, 0);
+		return;
+	}
+	/* HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only if asked to */
+	c->req.http11 = strcmp(p->protocol, "HTTP/1.0") != 0;
+	c->req.keep_alive = c->req.http11;
+	if (p->connection && header_has(p->connection, "close")) {
+		c->req.keep_alive = false;
+	} else if (p->connection && header_has(p->connection, "keep-alive")) {
+		c->req.keep_alive = true;
+	}
+	c->req.keep_alive = c->req.keep_alive && ++c->requests < KEEPALIVE_REQUESTS;
+	c->req.gzip = p->accept_encoding && accepts_gzip(p->accept_encoding);
+	c->req.format = p->accept ? negotiate_format(p->accept) : FORMAT_TEXT;
+	size_t len;
+	const char *name = query_param(p->query, "format", &len);
+	for (int i = 0; name && i < BODY_FORMATS; i++) {
+		if (strlen(format_name[i]) == len && strncmp(name, format_name[i], len) == 0) {
+			c->req.format = (enum body_format)i;
+		}
+	}
 
-		/* Wait for shit to finish */
-		err = 1;
-		nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-		while (err > 0) {
-			int rv = nl_recvmsgs(ctx.nls, cb);
-			if (rv != 0) {
-				fprintf(stderr, "Failed to receive netlink message: %s", strerror(-rv));
+	if (strcmp(p->path, "/") == 0) {
+		conn_respond(c, "200 OK", "text/html", NULL, ROOTPAGE, strlen(ROOTPAGE));
+	} else if (strcmp(p->path, "/metrics") != 0) {
+		conn_respond(c, "404 Not Found", "text/html", NULL, NOT_FOUND_ERROR, strlen(NOT_FOUND_ERROR));
+	} else {
+		/* Caches in front must keep the formats and encodings apart */
+		c->req.negotiated = true;
+		conn_metrics_request(c);
+	}
+}
 
-				/* Free the shite */
-				nlmsg_free(msg);
-				nl_cb_put(cb);
+/* Send as much of the response as the socket takes, -EAGAIN if it is full */
+static int conn_write(struct conn *c)
+{
+	for (;;) {
+		ssize_t n;
+		if (c->sent < c->split) {
+			bool more = c->split < c->out.len || c->file_len || c->snap;
+			n = send(c->fd, c->out.buf + c->sent, c->split - c->sent, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		} else if (c->file >= 0 && c->file_off < (off_t)c->file_len) {
+			n = sendfile(c->fd, c->file, &c->file_off, c->file_len - (size_t)c->file_off);
+			if (n == 0) {
+				return -EIO;
+			}
+			if (n > 0) {
+				clock_gettime(CLOCK_MONOTONIC, &c->active);
+				continue;
+			}
+		} else if (c->sent < c->out.len) {
+			n = send(c->fd, c->out.buf + c->sent, c->out.len - c->sent, MSG_NOSIGNAL);
+		} else if (c->snap) {
+			int rv = conn_stream_more(c);
+			if (rv) {
 				return rv;
 			}
+			continue;
+		} else {
+			return 0;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EWOULDBLOCK ? -EAGAIN : -errno;
 		}
+		c->sent += (size_t)n;
+		clock_gettime(CLOCK_MONOTONIC, &c->active);
+	}
+}
 
-		/* Free the shite */
-		nlmsg_free(msg);
-		nl_cb_put(cb);
-	
-		/* Allocate new message */
-		msg = nlmsg_alloc();
-		if (!msg) {
-			fprintf(stderr, "Failed to allocate netlink message.\n");
-			nl_socket_free(ctx.nls);
-			return -ENOMEM;
+/* Advance a connection as far as it goes without blocking */
+static void conn_run(struct conn *c)
+{
+	for (;;) {
+		if (c->state == CONN_COLLECT) {
+			conn_watch(c, 0);
+			return;
 		}
-		cb = nl_cb_alloc(NL_CB_CUSTOM);
-		if (!cb) {
-			fprintf(stderr, "Failed to allocate netlink callback.\n");
-			nlmsg_free(msg);
-			nl_socket_free(ctx.nls);
-			return -ENOMEM;
+		if (c->state == CONN_READ) {
+			size_t len = http_parse(&c->parser, c->in, c->in_len);
+			if (!len && c->eof) {
+				conn_close(c);
+				return;
+			}
+			if (!len && c->in_len < sizeof(c->in)) {
+				conn_watch(c, EPOLLIN);
+				return;
+			}
+			if (!len) {
+				memset(&c->req, 0, sizeof(c->req));
+				conn_respond(c, "431 Request Header Fields Too Large", "text/plain", NULL, NULL, 0);
+			} else {
+				conn_request(c, &c->parser);
+				/* Pipelined requests stay for later */
+				memmove(c->in, c->in + len, c->in_len - len);
+				c->in_len -= len;
+				memset(&c->parser, 0, sizeof(c->parser));
+			}
+			continue;
 		}
-
-		/* Send a GET_SURVEY command */
-		nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, survey_dump_handler, &ctx);
-		genlmsg_put(msg, 0, 0, ctx.nl80211_id, 0, NLM_F_DUMP, NL80211_CMD_GET_SURVEY, 0);
-		nla_put_u32(msg, NL80211_ATTR_IFINDEX, ctx.if_index[i]);
-		nl_send_auto_complete(ctx.nls, msg);
-
-
-		/* Wait for shit to finish */
-		err = 1;
-		nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-		while (err > 0) {
-			int rv = nl_recvmsgs(ctx.nls, cb);
-			if (rv != 0) {
-				fprintf(stderr, "Failed to receive netlink message: %s", strerror(-rv));
-
-				/* Free the shite */
-				nlmsg_free(msg);
-				nl_cb_put(cb);
-				return rv;
+		int rv = c->out.failed ? -ENOMEM : conn_write(c);
+		if (rv == -EAGAIN) {
+			conn_watch(c, EPOLLOUT);
+			return;
+		}
+		if (rv || !c->req.keep_alive) {
+			if (rv) {
+				fprintf(stderr, "Failed to send a response: %s\n", strerror(-rv));
 			}
+			conn_close(c);
+			return;
 		}
-
-		/* Free the shite */
-		nlmsg_free(msg);
-		nl_cb_put(cb);
+		conn_reset(c);
+		c->state = CONN_READ;
 	}
-	for (int i = 0; i < ctx.if_count; i++) {
-		char dev[IFNAMSIZ];
-		if_indextoname(ctx.if_index[i], dev);
-		fprintf(stream, "wlan_num_stations{device=\"%s\"} %ju\n",
-			dev, (uintmax_t)ctx.if_num_sta[i]);
-	}
-	nl_socket_free(ctx.nls);
-	return 0;
 }
 
-/* Single function HTTP/1.0 web server */
-static void http_handler(FILE *stream) {
-	char status[80] = {0};
-	char *rv = fgets(status, sizeof(status) - 1, stream);
-	if (rv != status) {
-		fprintf(stderr, "fgets error: %s\n", strerror(errno));
-		return;
-	}
-	char *saveptr;
-	char *method = strtok_r(status, " \t\r\n", &saveptr);
-	if (strncmp(method, "GET", 4) != 0) {
-		fputs("HTTP/1.0 405 Method Not Allowed\r\n", stream);
-		return;
-	}
-	char *request_uri = strtok_r(NULL, " \t", &saveptr);
-	char *protocol = strtok_r(NULL, " \t\r\n", &saveptr);
-	if (strncmp(protocol, "HTTP/1.", 7) != 0) {
-		fputs("HTTP/1.0 400 Bad Request\r\n", stream);
-		return;
-	}
-	/* Read the other headers */
-	for (;;) {
-		char header[1024];
-		rv = fgets(header, sizeof(header) - 1, stream);
-		if (rv != header) {
-			fprintf(stderr, "fgets error: %s\n", strerror(errno));
+static void conn_read(struct conn *c)
+{
+	while (c->in_len < sizeof(c->in)) {
+		ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EWOULDBLOCK) {
+			break;
+		}
+		if (n < 0) {
+			conn_close(c);
 			return;
 		}
-		if (header[0] == '\n' || header[1] == '\n') {
+		if (n == 0) {
+			/* Requests already received are still answered */
+			c->eof = true;
 			break;
 		}
+		c->in_len += (size_t)n;
+		clock_gettime(CLOCK_MONOTONIC, &c->active);
 	}
-	if (strcmp(request_uri, "/") == 0) {
-		fprintf(stream, "HTTP/1.0 200 OK\r\nContent-Length: %lu\r\n\r\n", (unsigned long)strlen(ROOTPAGE));
-		fputs(ROOTPAGE, stream);
-		return;
+	conn_run(c);
+}
+
+/* Close connections that made no progress for the idle timeout. Scrapes
+ * waiting for a collection are not idle. */
+static void conns_expire(void)
+{
+	for (size_t fd = 0; fd < conns_alloc; fd++) {
+		struct conn *c = conns[fd];
+		if (c && c->state != CONN_COLLECT && elapsed_ms(&c->active) > KEEPALIVE_IDLE_S * 1000) {
+			conn_close(c);
+		}
 	}
-	if (strcmp(request_uri, "/metrics") != 0) {
-		fprintf(stream, "HTTP/1.0 404 Not Found\r\nContent-Length: %lu\r\n\r\n", (unsigned long)strlen(NOT_FOUND_ERROR));
-		fputs(NOT_FOUND_ERROR, stream);
-		return;
+}
+
+/* Answer a connection over the limit with a 503 without reading its
+ * request. What arrived of it is drained so the close does not reset the
+ * connection before the client reads the answer. */
+static void conn_refuse(int fd)
+{
+	static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\n"
+		"Content-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+	char discard[REQUEST_SIZE];
+
+	while (recv(fd, discard, sizeof(discard), 0) > 0) {
+	}
+	send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+	close(fd);
+}
+
+static void conns_accept(int listenfd)
+{
+	for (;;) {
+		int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+			}
+			if (errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+		if (conns_open >= max_connections) {
+			conn_refuse(fd);
+		} else if (!conn_new(fd)) {
+			fprintf(stderr, "Failed to set up a connection: %s\n", strerror(errno));
+			close(fd);
+		}
 	}
-	fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n", stream);
-	show_metrics(stream);
 }
 
 /* Generic TCP server set-up with multiple sockets */
-static void start_listen(const char *node, const char *service, int *fd, int max_fd)
+static void start_listen(const char *node, const char *service, int *fd, int max_fd, bool reuseport)
 {
 	/* This union fixes the broking casting sockaddr API with strict aliasing rules.
 	 *
@@ -761,6 +4615,11 @@ static void start_listen(const char *node, const char *service, int *fd, int max
 		if (rv < 0) {
 			perror("Failed setsockopt");
 		}
+		/* Every worker listens on a socket of its own, the kernel spreads
+		 * connections over them */
+		if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+			perror("Failed setsockopt");
+		}
 		if (p->ai_family == AF_INET6) {
 			u.sa = *p->ai_addr;
 			inet_ntop(AF_INET6, &u.sa_in6.sin6_addr, address, INET6_ADDRSTRLEN);
@@ -789,52 +4648,152 @@ static void start_listen(const char *node, const char *service, int *fd, int max
 	return;
 }
 
-/* Socket epoll, linux-specific */
-union my_sockaddr {
-	struct sockaddr_storage storage;
-	struct sockaddr addr;
-	struct sockaddr_in sin_addr;
-	struct sockaddr_in6 sin6_addr;
-};
+/* The parent of a worker pool only restarts workers that exit. Workers
+ * return from here, the parent never does. */
+static void supervise(int workers)
+{
+	pid_t *pid = calloc((size_t)workers, sizeof(*pid));
+	pid_t parent = getpid();
+
+	if (!pid) {
+		fprintf(stderr, "Failed to start workers: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (;;) {
+		for (int i = 0; i < workers; i++) {
+			if (pid[i] > 0) {
+				continue;
+			}
+			pid[i] = fork();
+			if (pid[i] == 0) {
+				/* Workers go down with the parent */
+				prctl(PR_SET_PDEATHSIG, SIGTERM);
+				if (getppid() != parent) {
+					exit(0);
+				}
+				free(pid);
+				return;
+			}
+			if (pid[i] < 0) {
+				fprintf(stderr, "Failed to start worker: %s\n", strerror(errno));
+			}
+		}
+		int status;
+		pid_t dead = waitpid(-1, &status, 0);
+		if (dead < 0 && errno == EINTR) {
+			continue;
+		}
+		for (int i = 0; i < workers; i++) {
+			if (pid[i] == dead) {
+				fprintf(stderr, "Worker %d exited with status %d, restarting it.\n", (int)dead, status);
+				pid[i] = 0;
+			}
+		}
+		/* Do not fork in a tight loop if workers keep dying */
+		sleep(1);
+	}
+}
+
+/* Every worker serves its connections from a single thread, the collector
+ * thread is the only one that blocks on nl80211 */
 int main (int argc, char **argv)
 {
-	UNUSED(argc);
-	UNUSED(argv);
-	int fd[2] = {0};
-	start_listen(NULL, "9100", fd, 2);
-	int epollfd = epoll_create1(0);
-	for (int i = 0; i < 2; i++) {
+	int workers = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:c:w:m:")) != -1) {
+		switch (opt) {
+		case 'i':
+			collect_interval_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			cache_window_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'm':
+			max_connections = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i collect_interval_ms] [-c cache_window_ms] [-w workers] "
+					"[-m max_connections]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int fd[2] = {-1, -1};
+	share_collections = workers > 1 && !collect_interval_ms;
+	int rv = shared_init();
+	if (rv) {
+		fprintf(stderr, "Failed to set up shared state: %s\n", strerror(-rv));
+		return 1;
+	}
+	/* A single worker runs without a parent */
+	if (workers > 1) {
+		supervise(workers);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	collect_wanted = eventfd(0, EFD_CLOEXEC);
+	collect_done = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (collect_wanted < 0 || collect_done < 0 || epollfd < 0) {
+		fprintf(stderr, "Failed to set up the event loop: %s\n", strerror(errno));
+		return 1;
+	}
+	if (collect_interval_ms) {
+		collect_publish();
+	}
+	pthread_t collector;
+	rv = pthread_create(&collector, NULL, collector_thread, NULL);
+	if (rv) {
+		fprintf(stderr, "Failed to start collector thread: %s\n", strerror(rv));
+		return 1;
+	}
+	start_listen(NULL, "9100", fd, 2, workers > 1);
+	for (int i = 0; i < 3; i++) {
+		int listenfd = i < 2 ? fd[i] : collect_done;
+		if (listenfd < 0) {
+			continue;
+		}
+		if (i < 2) {
+			fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+		}
 		struct epoll_event ev = {0};
 		ev.events = EPOLLIN;
-		ev.data.fd = fd[i];
-		int rv = epoll_ctl(epollfd, EPOLL_CTL_ADD, fd[i], &ev);
+		ev.data.fd = listenfd;
+		rv = epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev);
 		if (rv == -1) {
-			fprintf(stderr, "epoll add failed for socket %d (fd %d): %s\n", i, fd[i], strerror(errno));
+			fprintf(stderr, "epoll add failed for fd %d: %s\n", listenfd, strerror(errno));
 		}
 	}
 	for(;;) {
-		struct epoll_event events[10] = {{0}};
-		int nfds = epoll_wait(epollfd, events, 10, -1);
-		if (nfds == -1) {
-			fprintf(stderr, "epoll wait failed: %s", strerror(errno));
+		struct epoll_event events[64];
+		/* Idle connections are only looked for while there are some */
+		int nfds = epoll_wait(epollfd, events, 64, conns_open ? 1000 : -1);
+		if (nfds == -1 && errno != EINTR) {
+			fprintf(stderr, "epoll wait failed: %s\n", strerror(errno));
 		}
 		for (int i = 0; i < nfds; i++) {
-			union my_sockaddr addr = {{0}};
-			socklen_t addrlen = 0;
-			int conn_sock = accept(events[i].data.fd, &addr.addr, &addrlen);
-			if (conn_sock < 0) {
-				fprintf(stderr, "Accept failed: %s", strerror(errno));
-				continue;
-			}
-			FILE *stream = fdopen(conn_sock, "r+");
-			if (stream == NULL) {
-				fprintf(stderr, "fdopen error: %s\n", strerror(errno));
-				close(conn_sock);
-				continue;
+			int event_fd = events[i].data.fd;
+			if (event_fd == fd[0] || event_fd == fd[1]) {
+				conns_accept(event_fd);
+			} else if (event_fd == collect_done) {
+				uint64_t n;
+				if (read(collect_done, &n, sizeof(n)) > 0) {
+					conns_collected();
+				}
+			} else if ((size_t)event_fd < conns_alloc && conns[event_fd]) {
+				struct conn *c = conns[event_fd];
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					conn_close(c);
+				} else if (c->state == CONN_READ) {
+					conn_read(c);
+				} else {
+					conn_run(c);
+				}
 			}
-			if (!fork()) { http_handler(stream); fclose(stream); exit(0); }
-			fclose(stream);
 		}
+		conns_expire();
 	}
 	
 	return 0;